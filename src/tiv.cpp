@@ -35,15 +35,39 @@
  *     limitations under the License.
  */
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <bit>
 #include <bitset>
+#include <cctype>
+#include <chrono>
+#include <compare>
+#include <condition_variable>
 #include <cmath>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
 #include <filesystem>
 #include <format>
+#include <functional>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <map>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
 #include <vector>
 
 // This #define tells CImg that we use the library without any display options,
@@ -57,8 +81,17 @@
 #ifdef _POSIX_VERSION
 // Console output size detection
 #include <sys/ioctl.h>
-// Error explanation, for some reason
-#include <cstring>
+// Gathered writes for the output queue
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <unistd.h>
+// Shared memory transfer for the kitty graphics protocol, mapped archives
+// and in-memory archive members
+#include <sys/mman.h>
+#include <sys/stat.h>
+// Terminal capability probing
+#include <termios.h>
 // Exit codes
 #include <sysexits.h>
 #endif
@@ -86,12 +119,35 @@
 
 // @TODO: Convert to bitset
 // Implementation of flag representation for flags in the main() method
-constexpr int FLAG_FG = 1;         // emit fg color
-constexpr int FLAG_BG = 2;         // emit bg color
-constexpr int FLAG_MODE_256 = 4;   // Limit colors to 256-color mode
-constexpr int FLAG_24BIT = 8;      // 24-bit color mode
-constexpr int FLAG_NOOPT = 16;     // Only use the same half-block character
-constexpr int FLAG_TELETEXT = 32;  // Use teletext characters
+constexpr int FLAG_FG = 1;             // emit fg color
+constexpr int FLAG_BG = 2;             // emit bg color
+constexpr int FLAG_MODE_256 = 4;       // Limit colors to 256-color mode
+constexpr int FLAG_24BIT = 8;          // 24-bit color mode
+constexpr int FLAG_NOOPT = 16;         // Only use the same half-block character
+constexpr int FLAG_TELETEXT = 32;      // Use teletext characters
+constexpr int FLAG_REP = 64;           // Repeat characters with CSI b (REP)
+constexpr int FLAG_SIXEL = 128;        // Sixel graphics instead of characters
+constexpr int FLAG_KITTY = 256;        // Kitty graphics protocol
+constexpr int FLAG_ITERM = 512;        // iTerm2 inline images
+constexpr int FLAG_HTML = 1024;        // HTML document instead of escape codes
+constexpr int FLAG_PALETTE = 2048;     // Redefine the 256 colors for each image
+constexpr int FLAG_MODE_16 = 4096;     // Limit colors to the basic 16
+constexpr int FLAG_MODE_8 = 8192;      // Limit colors to the basic 8
+constexpr int FLAG_DITHER = 16384;     // Ordered dithering for reduced colors
+constexpr int FLAG_LINEAR = 32768;     // Average colors in linear light
+constexpr int FLAG_OKLAB = 65536;      // Compare colors in Oklab color space
+constexpr int FLAG_LANCZOS = 131072;   // Resample with Lanczos3
+constexpr int FLAG_MITCHELL = 262144;  // Resample with Mitchell-Netravali
+constexpr int FLAG_SNAP = 524288;      // Resize by integer ratios only
+// Modes that draw actual pixels rather than characters
+constexpr int FLAG_PIXELS = FLAG_SIXEL | FLAG_KITTY | FLAG_ITERM;
+
+// Synchronized update modes. In-place redraws are wrapped in these so the
+// terminal only paints a frame after parsing all of it.
+enum SyncMode { SYNC_OFF, SYNC_2026, SYNC_DCS };
+// DEC private mode 2026, and the older DCS form understood by iTerm2 and kitty
+constexpr const char *SYNC_BEGIN[] = {"", "\x1b[?2026h", "\x1bP=1s\x1b\\"};
+constexpr const char *SYNC_END[] = {"", "\x1b[?2026l", "\x1bP=2s\x1b\\"};
 
 // Color saturation value steps from 0 to 255
 constexpr int COLOR_STEP_COUNT = 6;
@@ -103,6 +159,30 @@ constexpr int GRAYSCALE_STEPS[GRAYSCALE_STEP_COUNT] = {
     0x08, 0x12, 0x1c, 0x26, 0x30, 0x3a, 0x44, 0x4e, 0x58, 0x62, 0x6c, 0x76,
     0x80, 0x8a, 0x94, 0x9e, 0xa8, 0xb2, 0xbc, 0xc6, 0xd0, 0xda, 0xe4, 0xee};
 
+// The basic ANSI colors as xterm shows them by default, in SGR order: 30-37
+// (or 40-47) followed by the bright variants 90-97 (or 100-107)
+constexpr int ANSI_COLORS[16][3] = {
+    {0, 0, 0},       {205, 0, 0},     {0, 205, 0},     {205, 205, 0},
+    {0, 0, 238},     {205, 0, 205},   {0, 205, 205},   {229, 229, 229},
+    {127, 127, 127}, {255, 0, 0},     {0, 255, 0},     {255, 255, 0},
+    {92, 92, 255},   {255, 0, 255},   {0, 255, 255},   {255, 255, 255}};
+
+// 8x8 Bayer matrix for ordered dithering
+constexpr int BAYER[8][8] = {
+    {0, 32, 8, 40, 2, 34, 10, 42},  {48, 16, 56, 24, 50, 18, 58, 26},
+    {12, 44, 4, 36, 14, 46, 6, 38}, {60, 28, 52, 20, 62, 30, 54, 22},
+    {3, 35, 11, 43, 1, 33, 9, 41},  {51, 19, 59, 27, 49, 17, 57, 25},
+    {15, 47, 7, 39, 13, 45, 5, 37}, {63, 31, 55, 23, 61, 29, 53, 21}};
+
+// Returns the dither threshold in (0, 1) for the background or foreground
+// color of a cell. Dithering works on cell colors since the pixels of a cell
+// are averaged anyway, and the two colors of a cell count as two pixels on
+// top of each other. Without --dither, this is always 0.5, i.e. rounding.
+inline float ditherThreshold(const int &flags, int column, int row, bool fg) {
+    if (!(flags & FLAG_DITHER)) return 0.5f;
+    return (BAYER[(2 * row + fg) & 7][column & 7] + 0.5f) / 64;
+}
+
 // An interleaved map of 4x8 bit character bitmaps (each hex digit represents a
 // row) to the corresponding unicode character code point.
 constexpr unsigned int BITMAPS[] = {
@@ -238,10 +318,105 @@ struct CharData {
     int codePoint;
 };
 
+// Returns the table from sRGB encoded bytes to 16-bit linear light.
+const std::array<uint16_t, 256> &srgbToLinear() {
+    static const auto table = [] {
+        std::array<uint16_t, 256> table;
+        for (int i = 0; i < 256; i++) {
+            double v = i / 255.0;
+            v = v <= 0.04045 ? v / 12.92 : std::pow((v + 0.055) / 1.055, 2.4);
+            table[i] = std::lround(v * 65535);
+        }
+        return table;
+    }();
+    return table;
+}
+
+// Returns the table from 16-bit linear light to sRGB encoded bytes.
+const std::array<uint8_t, 65536> &linearToSrgb() {
+    static const auto table = [] {
+        std::array<uint8_t, 65536> table;
+        for (int i = 0; i < 65536; i++) {
+            double v = i / 65535.0;
+            v = v <= 0.0031308 ? v * 12.92
+                               : 1.055 * std::pow(v, 1 / 2.4) - 0.055;
+            table[i] = std::lround(v * 255);
+        }
+        return table;
+    }();
+    return table;
+}
+
+// Linear sRGB to cone responses, and cube roots of those to Oklab, both in
+// 12-bit fixed point. See https://bottosson.github.io/posts/oklab/
+constexpr int OKLAB_LMS[3][3] = {
+    {1688, 2197, 211}, {868, 2788, 440}, {362, 1154, 2580}};
+constexpr int OKLAB_LAB[3][3] = {
+    {862, 3251, -17}, {8102, -9948, 1846}, {106, 3206, -3312}};
+
+/**
+ * @brief Converts an sRGB color to Oklab, with integer arithmetic and lookup
+ * tables only.
+ *
+ * @return L from 0 to 65535 and a, b at the same scale
+ */
+std::array<int, 3> toOklab(int r, int g, int b) {
+    static const auto cubeRoot = [] {
+        std::array<uint16_t, 65536> table;
+        for (int i = 0; i < 65536; i++) {
+            table[i] = std::lround(std::cbrt(i / 65535.0) * 65535);
+        }
+        return table;
+    }();
+    const std::array<uint16_t, 256> &toLinear = srgbToLinear();
+    const int linear[3] = {toLinear[r], toLinear[g], toLinear[b]};
+    int lms[3];
+    for (int i = 0; i < 3; i++) {
+        int v = (OKLAB_LMS[i][0] * linear[0] + OKLAB_LMS[i][1] * linear[1] +
+                 OKLAB_LMS[i][2] * linear[2] + 2048) >>
+                12;
+        lms[i] = cubeRoot[std::clamp(v, 0, 65535)];
+    }
+    std::array<int, 3> lab;
+    for (int i = 0; i < 3; i++) {
+        lab[i] = (OKLAB_LAB[i][0] * lms[0] + OKLAB_LAB[i][1] * lms[1] +
+                  OKLAB_LAB[i][2] * lms[2]) /
+                 4096;
+    }
+    return lab;
+}
+
+// Returns the coordinates of a color in the space colors are compared in:
+// Oklab with FLAG_OKLAB, RGB otherwise.
+std::array<int, 3> colorCoords(const int &flags, int r, int g, int b) {
+    return flags & FLAG_OKLAB ? toOklab(r, g, b) : std::array<int, 3>{r, g, b};
+}
+
+// Returns the squared distance of two colors given by colorCoords().
+long coordsDistance(const std::array<int, 3> &c1,
+                    const std::array<int, 3> &c2) {
+    long distance = 0;
+    for (int i = 0; i < 3; i++) {
+        long d = c1[i] - c2[i];
+        distance += d * d;
+    }
+    return distance;
+}
+
+// Returns the squared distance of two sRGB colors, see colorCoords().
+long colorDistance(const int &flags, int r1, int g1, int b1, int r2, int g2,
+                   int b2) {
+    return coordsDistance(colorCoords(flags, r1, g1, b1),
+                          colorCoords(flags, r2, g2, b2));
+}
+
 // Return a CharData struct with the given code point and corresponding
-// average fg and bg colors.
+// average fg and bg colors. With FLAG_LINEAR, colors are averaged in linear
+// light, so that fine detail keeps its brightness.
 CharData createCharData(const cimg_library::CImg<unsigned char> &image, int x0,
-                        int y0, int codepoint, int pattern) {
+                        int y0, int codepoint, int pattern, const int &flags) {
+    const bool linear = flags & FLAG_LINEAR;
+    const std::array<uint16_t, 256> &toLinear = srgbToLinear();
     CharData result;
     result.codePoint = codepoint;
     int fg_count = 0;
@@ -259,7 +434,8 @@ CharData createCharData(const cimg_library::CImg<unsigned char> &image, int x0,
                 bg_count++;
             }
             for (int i = 0; i < 3; i++) {
-                avg[i] += image(x0 + x, y0 + y, 0, i);
+                int value = image(x0 + x, y0 + y, 0, i);
+                avg[i] += linear ? toLinear[value] : value;
             }
             mask = mask >> 1;
         }
@@ -273,6 +449,10 @@ CharData createCharData(const cimg_library::CImg<unsigned char> &image, int x0,
         if (fg_count != 0) {
             result.fgColor[i] /= fg_count;
         }
+        if (linear) {
+            result.bgColor[i] = linearToSrgb()[result.bgColor[i]];
+            result.fgColor[i] = linearToSrgb()[result.fgColor[i]];
+        }
     }
     return result;
 }
@@ -288,27 +468,39 @@ CharData createCharData(const cimg_library::CImg<unsigned char> &image, int x0,
  * used to render the 4x8 area
  */
 CharData findCharData(const cimg_library::CImg<unsigned char> &image, int x0,
-                      int y0, const int8_t &flags) {
-    int min[3] = {255, 255, 255};
-    int max[3] = {0};
-    std::map<long, int> count_per_color;
+                      int y0, const int &flags) {
+    int min[3] = {std::numeric_limits<int>::max(),
+                  std::numeric_limits<int>::max(),
+                  std::numeric_limits<int>::max()};
+    int max[3] = {std::numeric_limits<int>::min(),
+                  std::numeric_limits<int>::min(),
+                  std::numeric_limits<int>::min()};
+    // The maps below have at most 32 nodes each, keep them on the stack
+    std::byte nodes[4096];
+    std::pmr::monotonic_buffer_resource memory(nodes, sizeof(nodes));
+    std::pmr::map<long, int> count_per_color(&memory);
+    // The pixels in the color space the split is made in, RGB or Oklab
+    std::array<int, 3> coords[32];
 
     // Determine the minimum and maximum value for each color channel
     for (int y = 0; y < 8; y++) {
         for (int x = 0; x < 4; x++) {
             long color = 0;
+            std::array<int, 3> &c = coords[y * 4 + x];
             for (int i = 0; i < 3; i++) {
-                int d = image(x0 + x, y0 + y, 0, i);
-                min[i] = std::min(min[i], d);
-                max[i] = std::max(max[i], d);
-
-                color = (color << 8) | d;
+                c[i] = image(x0 + x, y0 + y, 0, i);
+                color = (color << 8) | c[i];
+            }
+            if (flags & FLAG_OKLAB) c = toOklab(c[0], c[1], c[2]);
+            for (int i = 0; i < 3; i++) {
+                min[i] = std::min(min[i], c[i]);
+                max[i] = std::max(max[i], c[i]);
             }
             count_per_color[color]++;
         }
     }
 
-    std::multimap<int, long> color_per_count;
+    std::pmr::multimap<int, long> color_per_count(&memory);
     for (auto i = count_per_color.begin(); i != count_per_color.end(); ++i) {
         color_per_count.insert(std::pair<int, long>(i->second, i->first));
     }
@@ -329,16 +521,16 @@ CharData findCharData(const cimg_library::CImg<unsigned char> &image, int x0,
         for (int y = 0; y < 8; y++) {
             for (int x = 0; x < 4; x++) {
                 bits = bits << 1;
-                int d1 = 0;
-                int d2 = 0;
-                for (int i = 0; i < 3; i++) {
-                    int shift = 16 - 8 * i;
-                    int c1 = (max_count_color_1 >> shift) & 255;
-                    int c2 = (max_count_color_2 >> shift) & 255;
-                    int c = image(x0 + x, y0 + y, 0, i);
-                    d1 += (c1 - c) * (c1 - c);
-                    d2 += (c2 - c) * (c2 - c);
-                }
+                int c[3];
+                for (int i = 0; i < 3; i++) c[i] = image(x0 + x, y0 + y, 0, i);
+                long d1 = colorDistance(flags, max_count_color_1 >> 16,
+                                        max_count_color_1 >> 8 & 255,
+                                        max_count_color_1 & 255, c[0], c[1],
+                                        c[2]);
+                long d2 = colorDistance(flags, max_count_color_2 >> 16,
+                                        max_count_color_2 >> 8 & 255,
+                                        max_count_color_2 & 255, c[0], c[1],
+                                        c[2]);
                 if (d1 > d2) {
                     bits |= 1;
                 }
@@ -364,7 +556,7 @@ CharData findCharData(const cimg_library::CImg<unsigned char> &image, int x0,
         for (int y = 0; y < 8; y++) {
             for (int x = 0; x < 4; x++) {
                 bits = bits << 1;
-                if (image(x0 + x, y0 + y, 0, splitIndex) > splitValue) {
+                if (coords[y * 4 + x][splitIndex] > splitValue) {
                     bits |= 1;
                 }
             }
@@ -411,7 +603,7 @@ CharData findCharData(const cimg_library::CImg<unsigned char> &image, int x0,
         }
         return result;
     }
-    return createCharData(image, x0, y0, codepoint, best_pattern);
+    return createCharData(image, x0, y0, codepoint, best_pattern, flags);
 }
 
 int clamp_byte(int value) {
@@ -433,14 +625,231 @@ int best_index(int value, const int STEPS[], int count) {
     return result;
 }
 
-std::string emitTermColor(const int8_t &flags, int r, int g, int b) {
-    r = clamp_byte(r), g = clamp_byte(g), b = clamp_byte(b);
+// Like best_index, but rounds up from the step below value only when the
+// distance to it exceeds threshold (in units of the distance between steps)
+int dither_index(int value, const int STEPS[], int count, float threshold) {
+    int i = 0;
+    while (i < count - 1 && STEPS[i + 1] <= value) i++;
+    if (i < count - 1 && value > STEPS[i] &&
+        value - STEPS[i] > threshold * (STEPS[i + 1] - STEPS[i])) {
+        i++;
+    }
+    return i;
+}
 
-    const bool bg = (flags & FLAG_BG);
+// Key of a color in a 15-bit (5 bits per channel) color histogram.
+inline int colorKey(int r, int g, int b) {
+    return (r >> 3) << 10 | (g >> 3) << 5 | (b >> 3);
+}
 
-    if (!(flags & FLAG_MODE_256)) {
-        // 2 means we output true (RGB) colors
-        return std::format("\x1b[{};2;{};{};{}m", bg ? 48 : 38, r, g, b);
+/**
+ * @brief A palette of up to 256 colors and the mapping from 15-bit colors to
+ * palette entries.
+ */
+struct Palette {
+    std::vector<std::array<int, 3>> colors;
+    std::array<uint8_t, 32768> index;  // Palette entry for each colorKey()
+};
+
+// Returns the index of the nearest color in the first 8 or 16 ANSI_COLORS,
+// depending on FLAG_MODE_8, from a table for all 15-bit colors.
+int nearestAnsi(int r, int g, int b, const int &flags) {
+    // For 8 and 16 colors, compared in RGB and in Oklab
+    static std::array<std::array<uint8_t, 32768>, 4> tables;
+    static std::once_flag built[4];
+    const int t = (flags & FLAG_MODE_8 ? 0 : 1) | (flags & FLAG_OKLAB ? 2 : 0);
+    std::call_once(built[t], [&] {
+        const int count = flags & FLAG_MODE_8 ? 8 : 16;
+        std::array<int, 3> colors[16];
+        for (int i = 0; i < count; i++) {
+            colors[i] = colorCoords(flags, ANSI_COLORS[i][0],
+                                    ANSI_COLORS[i][1], ANSI_COLORS[i][2]);
+        }
+        for (int key = 0; key < 32768; key++) {
+            // Compare to the center of the bin
+            std::array<int, 3> color =
+                colorCoords(flags, (key >> 10) << 3 | 4,
+                            (key >> 5 & 31) << 3 | 4, (key & 31) << 3 | 4);
+            long bestDistance = std::numeric_limits<long>::max();
+            for (int i = 0; i < count; i++) {
+                long distance = coordsDistance(colors[i], color);
+                if (distance < bestDistance) {
+                    bestDistance = distance;
+                    tables[t][key] = i;
+                }
+            }
+        }
+    });
+    return tables[t][colorKey(r, g, b)];
+}
+
+// Number of colors mixed by knollDither()
+constexpr int KNOLL_CANDIDATES = 8;
+
+/**
+ * @brief Ordered dithering for palettes that are not a regular grid, after
+ * Thomas Knoll's pattern dithering.
+ *
+ * Collects a mix of palette colors that averages out to the given color, by
+ * repeatedly taking the nearest color to it plus the error accumulated so
+ * far. The threshold then picks one of the mix sorted by brightness.
+ *
+ * @param color The color to dither
+ * @param threshold The threshold from ditherThreshold()
+ * @param nearest Returns the index of the nearest palette color to r, g, b
+ * @param value Returns the palette color at an index
+ * @return The palette index
+ */
+template <typename Nearest, typename Value>
+int knollDither(const int color[3], float threshold, const Nearest &nearest,
+                const Value &value) {
+    // Brightness in the upper bits, so sorting the keys sorts the colors
+    int keys[KNOLL_CANDIDATES];
+    int error[3] = {0, 0, 0};
+    for (int k = 0; k < KNOLL_CANDIDATES; k++) {
+        int i = nearest(clamp_byte(color[0] + error[0]),
+                        clamp_byte(color[1] + error[1]),
+                        clamp_byte(color[2] + error[2]));
+        const int *chosen = value(i);
+        for (int c = 0; c < 3; c++) error[c] += color[c] - chosen[c];
+        keys[k] = (299 * chosen[0] + 587 * chosen[1] + 114 * chosen[2]) << 8 |
+                  i;
+    }
+    std::sort(keys, keys + KNOLL_CANDIDATES);
+    return keys[static_cast<int>(threshold * KNOLL_CANDIDATES)] & 255;
+}
+
+/**
+ * @brief Find the best character and basic ANSI colors for the given 4x8 area
+ * of the image, for --16 and --8.
+ *
+ * With so few colors, picking the character first and rounding its colors
+ * afterwards does badly, so every character is tried with the colors that fit
+ * it best. For a given character the squared error of each half only depends
+ * on the pixel count and sum of that half, so the best color for either half
+ * is found with one pass over the color table.
+ *
+ * @param image The image where the pixels reside
+ * @param x0 The x coordinate of the top left pixel of the area
+ * @param y0 The y coordinate of the top left pixel of the area
+ * @param flags
+ * @return The @ref CharData with colors from ANSI_COLORS
+ */
+CharData findAnsiCharData(const cimg_library::CImg<unsigned char> &image,
+                          int x0, int y0, const int &flags) {
+    const int colors = flags & FLAG_MODE_8 ? 8 : 16;
+    int norm[16];
+    for (int i = 0; i < colors; i++) {
+        norm[i] = sqr(ANSI_COLORS[i][0]) + sqr(ANSI_COLORS[i][1]) +
+                  sqr(ANSI_COLORS[i][2]);
+    }
+    int pixels[32][3];
+    int total[3] = {0, 0, 0};
+    for (int y = 0; y < 8; y++) {
+        for (int x = 0; x < 4; x++) {
+            for (int i = 0; i < 3; i++) {
+                pixels[y * 4 + x][i] = image(x0 + x, y0 + y, 0, i);
+                total[i] += pixels[y * 4 + x][i];
+            }
+        }
+    }
+    // Returns the error of the best color for count pixels summing up to sum,
+    // leaving out the constant sum of squares
+    auto best = [&](int count, const int sum[3], int &color) {
+        long bestError = std::numeric_limits<long>::max();
+        for (int i = 0; i < colors; i++) {
+            long error = static_cast<long>(count) * norm[i];
+            for (int c = 0; c < 3; c++) {
+                error -= 2L * ANSI_COLORS[i][c] * sum[c];
+            }
+            if (error < bestError) bestError = error, color = i;
+        }
+        return bestError;
+    };
+
+    CharData result;
+    long bestError = std::numeric_limits<long>::max();
+    int fgMean[3] = {0, 0, 0};
+    int bgMean[3] = {0, 0, 0};
+    unsigned int end_marker = flags & FLAG_TELETEXT ? 1 : 0;
+    for (int i = 0; BITMAPS[i + 1] != end_marker; i += 2) {
+        // Skip all end markers. Inverted patterns need not be tried, since
+        // the colors of both halves are chosen independently.
+        if (BITMAPS[i + 1] < 32) continue;
+        unsigned int pattern = flags & FLAG_NOOPT ? 0x0000ffff : BITMAPS[i];
+        int count = 0;
+        int sum[3] = {0, 0, 0};
+        for (int p = 0; p < 32; p++) {
+            if (pattern & (0x80000000u >> p)) {
+                count++;
+                for (int c = 0; c < 3; c++) sum[c] += pixels[p][c];
+            }
+        }
+        int rest[3] = {total[0] - sum[0], total[1] - sum[1], total[2] - sum[2]};
+        int fg = 0;
+        int bg = 0;
+        long error = best(count, sum, fg) + best(32 - count, rest, bg);
+        if (error < bestError) {
+            bestError = error;
+            result.codePoint = flags & FLAG_NOOPT ? 0x2584 : BITMAPS[i + 1];
+            for (int c = 0; c < 3; c++) {
+                result.fgColor[c] = ANSI_COLORS[fg][c];
+                result.bgColor[c] = ANSI_COLORS[bg][c];
+                fgMean[c] = count ? sum[c] / count : 0;
+                bgMean[c] = count < 32 ? rest[c] / (32 - count) : 0;
+            }
+        }
+        if (flags & FLAG_NOOPT) break;
+    }
+
+    if (flags & FLAG_DITHER) {
+        // The character is chosen as without dithering, only its colors
+        // are dithered
+        auto nearest = [&](int r, int g, int b) {
+            return nearestAnsi(r, g, b, flags);
+        };
+        auto value = [](int i) { return ANSI_COLORS[i]; };
+        int fg = knollDither(fgMean,
+                             ditherThreshold(flags, x0 / 4, y0 / 8, true),
+                             nearest, value);
+        int bg = knollDither(bgMean,
+                             ditherThreshold(flags, x0 / 4, y0 / 8, false),
+                             nearest, value);
+        for (int c = 0; c < 3; c++) {
+            result.fgColor[c] = ANSI_COLORS[fg][c];
+            result.bgColor[c] = ANSI_COLORS[bg][c];
+        }
+    }
+    return result;
+}
+
+// Palette entries from here on are redefined for --palette, the first 16 are
+// left alone since other programs rely on them.
+constexpr int PALETTE_OFFSET = 16;
+
+/**
+ * @brief Returns the 256-color mode palette entry for a color: one of the
+ * adaptive palette, or of the predefined color cube and gray ramp.
+ *
+ * @param flags
+ * @param r, g, b The color
+ * @param palette Adaptive palette for --palette, or null
+ * @param threshold The threshold from ditherThreshold(), for FLAG_DITHER
+ */
+int paletteIndex(const int &flags, int r, int g, int b,
+                 const Palette *palette, float threshold) {
+    if (palette) {
+        int color = palette->index[colorKey(r, g, b)];
+        if (flags & FLAG_DITHER) {
+            const int rgb[3] = {r, g, b};
+            color = knollDither(
+                rgb, threshold,
+                [&](int r, int g, int b) {
+                    return palette->index[colorKey(r, g, b)];
+                },
+                [&](int i) { return palette->colors[i].data(); });
+        }
+        return PALETTE_OFFSET + color;
     }
 
     // Compute predefined color index from all 256 colors we should use
@@ -459,83 +868,93 @@ std::string emitTermColor(const int8_t &flags, int r, int g, int b) {
     int gri = best_index(gray, GRAYSCALE_STEPS, GRAYSCALE_STEP_COUNT);
     int grq = GRAYSCALE_STEPS[gri];
 
-    int color_index;
-    if (0.3 * sqr(rq - r) + 0.59 * sqr(gq - g) + 0.11 * sqr(bq - b) <
-        0.3 * sqr(grq - r) + 0.59 * sqr(grq - g) + 0.11 * sqr(grq - b)) {
-        color_index = 16 + 36 * ri + 6 * gi + bi;
-    } else {
-        color_index = 232 + gri;  // 1..24 -> 232..255
+    bool cube =
+        flags & FLAG_OKLAB
+            ? colorDistance(flags, rq, gq, bq, r, g, b) <
+                  colorDistance(flags, grq, grq, grq, r, g, b)
+            : 0.3 * sqr(rq - r) + 0.59 * sqr(gq - g) + 0.11 * sqr(bq - b) <
+                  0.3 * sqr(grq - r) + 0.59 * sqr(grq - g) +
+                      0.11 * sqr(grq - b);
+    if (cube) {
+        if (flags & FLAG_DITHER) {
+            ri = dither_index(r, COLOR_STEPS, COLOR_STEP_COUNT, threshold);
+            gi = dither_index(g, COLOR_STEPS, COLOR_STEP_COUNT, threshold);
+            bi = dither_index(b, COLOR_STEPS, COLOR_STEP_COUNT, threshold);
+        }
+        return 16 + 36 * ri + 6 * gi + bi;
     }
-    // 38 sets the foreground color and 48 sets the background color
-    return std::format("\x1b[{};5;{}m", bg ? 48 : 38, color_index);
-}
-
-void emitCodepoint(int codepoint) {
-    if (codepoint < 128) {
-        std::cout << static_cast<char>(codepoint);
-    } else if (codepoint < 0x7ff) {
-        std::cout << static_cast<char>(0xc0 | (codepoint >> 6));
-        std::cout << static_cast<char>(0x80 | (codepoint & 0x3f));
-    } else if (codepoint < 0xffff) {
-        std::cout << static_cast<char>(0xe0 | (codepoint >> 12));
-        std::cout << static_cast<char>(0x80 | ((codepoint >> 6) & 0x3f));
-        std::cout << static_cast<char>(0x80 | (codepoint & 0x3f));
-    } else if (codepoint < 0x10ffff) {
-        std::cout << static_cast<char>(0xf0 | (codepoint >> 18));
-        std::cout << static_cast<char>(0x80 | ((codepoint >> 12) & 0x3f));
-        std::cout << static_cast<char>(0x80 | ((codepoint >> 6) & 0x3f));
-        std::cout << static_cast<char>(0x80 | (codepoint & 0x3f));
-    } else {
-        std::cerr << "ERROR";
+    if (flags & FLAG_DITHER) {
+        gri = dither_index(gray, GRAYSCALE_STEPS, GRAYSCALE_STEP_COUNT,
+                           threshold);
     }
+    return 232 + gri;  // 1..24 -> 232..255
 }
 
-std::string emitImage(const cimg_library::CImg<unsigned char> &image,
-                      const int8_t &flags) {
-    std::string ret;
-    CharData lastCharData;
-    for (int y = 0; y <= image.height() - 8; y += 8) {
-        for (int x = 0; x <= image.width() - 4; x += 4) {
-            // Create CharData for the current 4x8 area of the image
-            // If only half-block chars are allowed, use predefined codepoint
-            CharData charData =
-                flags & FLAG_NOOPT
-                    ? createCharData(image, x, y, 0x2584, 0x0000ffff)
-                    : findCharData(image, x, y, flags);
-            if (x == 0 || charData.bgColor != lastCharData.bgColor)
-                ret += emitTermColor(flags | FLAG_BG, charData.bgColor[0],
-                                     charData.bgColor[1], charData.bgColor[2]);
-            if (x == 0 || charData.fgColor != lastCharData.fgColor)
-                ret += emitTermColor(flags | FLAG_FG, charData.fgColor[0],
-                                     charData.fgColor[1], charData.fgColor[2]);
-            ret += (charData.codePoint);
-            lastCharData = charData;
-        }
-        ret += "\x1b[0m\n";  // clear formatting until next batch
+// Whether colors are written as 256-color mode palette entries.
+inline bool paletteMode(const int &flags) {
+    return (flags & FLAG_MODE_256) && !(flags & (FLAG_MODE_16 | FLAG_MODE_8));
+}
+
+// Appends the escape sequence that sets the foreground color, or the
+// background color with FLAG_BG, to a 256-color mode palette entry.
+void emitPaletteColor(std::pmr::string &out, const int &flags, int index) {
+    // 38 sets the foreground color and 48 sets the background color
+    std::format_to(std::back_inserter(out), "\x1b[{};5;{}m",
+                   flags & FLAG_BG ? 48 : 38, index);
+}
+
+/**
+ * @brief Appends the escape sequence that sets the foreground color, or the
+ * background color with FLAG_BG, in the color mode selected in the flags.
+ */
+void emitTermColor(std::pmr::string &out, const int &flags, int r, int g,
+                   int b, const Palette *palette = nullptr,
+                   float threshold = 0.5f) {
+    r = clamp_byte(r), g = clamp_byte(g), b = clamp_byte(b);
+
+    const bool bg = (flags & FLAG_BG);
+
+    if (flags & (FLAG_MODE_16 | FLAG_MODE_8)) {
+        int i = nearestAnsi(r, g, b, flags);
+        // 30-37 and 40-47, or the bright 90-97 and 100-107
+        std::format_to(std::back_inserter(out), "\x1b[{}m",
+                       (i < 8 ? 30 : 82) + (bg ? 10 : 0) + i);
+        return;
     }
-    return ret;
+
+    if (!(flags & FLAG_MODE_256)) {
+        // 2 means we output true (RGB) colors
+        std::format_to(std::back_inserter(out), "\x1b[{};2;{};{};{}m",
+                       bg ? 48 : 38, r, g, b);
+        return;
+    }
+
+    emitPaletteColor(out, flags,
+                     paletteIndex(flags, r, g, b, palette, threshold));
 }
 
 /**
- * @brief Helper function to print a codepoint in a terminal-friendly way
+ * @brief Helper function to append a codepoint in a terminal-friendly way
  *
- * @param codepoint The codepoint to print
+ * @param out The string to append the UTF-8 encoded codepoint to
+ * @param codepoint The codepoint to append
  */
-void printCodepoint(int codepoint) {
+template <typename String>
+void emitCodepoint(String &out, int codepoint) {
     if (codepoint < 128) {  // ASCII
-        std::cout << static_cast<char>(codepoint);
+        out += static_cast<char>(codepoint);
     } else if (codepoint < 0x7ff) {  // 2-byte UTF-8
-        std::cout << static_cast<char>(0xc0 | (codepoint >> 6));
-        std::cout << static_cast<char>(0x80 | (codepoint & 0x3f));
+        out += static_cast<char>(0xc0 | (codepoint >> 6));
+        out += static_cast<char>(0x80 | (codepoint & 0x3f));
     } else if (codepoint < 0xffff) {  // 3-byte UTF-8
-        std::cout << static_cast<char>(0xe0 | (codepoint >> 12));
-        std::cout << static_cast<char>(0x80 | ((codepoint >> 6) & 0x3f));
-        std::cout << static_cast<char>(0x80 | (codepoint & 0x3f));
+        out += static_cast<char>(0xe0 | (codepoint >> 12));
+        out += static_cast<char>(0x80 | ((codepoint >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (codepoint & 0x3f));
     } else if (codepoint < 0x10ffff) {  // 4-byte UTF-8
-        std::cout << static_cast<char>(0xf0 | (codepoint >> 18));
-        std::cout << static_cast<char>(0x80 | ((codepoint >> 12) & 0x3f));
-        std::cout << static_cast<char>(0x80 | ((codepoint >> 6) & 0x3f));
-        std::cout << static_cast<char>(0x80 | (codepoint & 0x3f));
+        out += static_cast<char>(0xf0 | (codepoint >> 18));
+        out += static_cast<char>(0x80 | ((codepoint >> 12) & 0x3f));
+        out += static_cast<char>(0x80 | ((codepoint >> 6) & 0x3f));
+        out += static_cast<char>(0x80 | (codepoint & 0x3f));
     } else {  //???
         std::cerr << std::format(
             "Error: Codepoint 0x{:08x} is out of range, skipping this pixel",
@@ -543,152 +962,4155 @@ void printCodepoint(int codepoint) {
     }
 }
 
+// Append count more copies of the last character, using REP (CSI b) where
+// that is shorter.
+void emitRepeat(std::pmr::string &out, int codepoint, int count) {
+    if (count > 2) {
+        std::format_to(std::back_inserter(out), "\x1b[{}b", count);
+        return;
+    }
+    for (int i = 0; i < count; i++) emitCodepoint(out, codepoint);
+}
+
 /**
- * @brief Outputs the given image.
- *
- * @param image The image to output.
- * @param flags
+ * @brief Create CharData for the 4x8 area of the image at x, y. If only
+ * half-block chars are allowed, use the predefined codepoint.
  */
-void printImage(const cimg_library::CImg<unsigned char> &image,
-                const int8_t &flags) {
-    CharData lastCharData;
-    for (int y = 0; y <= image.height() - 8; y += 8) {
-        for (int x = 0; x <= image.width() - 4; x += 4) {
-            // Create CharData for the current 4x8 area of the image
-            // If only half-block chars are allowed, use predefined codepoint
-            CharData charData =
-                flags & FLAG_NOOPT
-                    ? createCharData(image, x, y, 0x2584, 0x0000ffff)
-                    : findCharData(image, x, y, flags);
-            if (x == 0 || charData.bgColor != lastCharData.bgColor)
-                std::cout << emitTermColor(flags | FLAG_BG, charData.bgColor[0],
-                                           charData.bgColor[1],
-                                           charData.bgColor[2]);
-            if (x == 0 || charData.fgColor != lastCharData.fgColor)
-                std::cout << emitTermColor(flags | FLAG_FG, charData.fgColor[0],
-                                           charData.fgColor[1],
-                                           charData.fgColor[2]);
-            printCodepoint(charData.codePoint);
-            lastCharData = charData;
-        }
-        std::cout << "\x1b[0m\n";  // clear formatting until next batch
+CharData findCell(const cimg_library::CImg<unsigned char> &image, int x, int y,
+                  const int &flags) {
+    if (flags & (FLAG_MODE_16 | FLAG_MODE_8)) {
+        return findAnsiCharData(image, x, y, flags);
     }
+    return flags & FLAG_NOOPT
+               ? createCharData(image, x, y, 0x2584, 0x0000ffff, flags)
+               : findCharData(image, x, y, flags);
 }
 
-struct size {
-    size(unsigned int in_width, unsigned int in_height)
-        : width(in_width), height(in_height) {}
-    explicit size(cimg_library::CImg<unsigned int> img)
-        : width(img.width()), height(img.height()) {}
-    unsigned int width;
-    unsigned int height;
-    size scaled(double scale) { return size(width * scale, height * scale); }
-    size fitted_within(size container) {
-        double scale = std::min(container.width / static_cast<double>(width),
-                                container.height / static_cast<double>(height));
-        return scaled(scale);
+/**
+ * @brief Finds the character cells of a single row, i.e. 8 pixel rows starting
+ * at y.
+ */
+std::pmr::vector<CharData> findRow(
+    const cimg_library::CImg<unsigned char> &image, int y, const int &flags,
+    std::pmr::memory_resource *memory = std::pmr::get_default_resource()) {
+    std::pmr::vector<CharData> cells(memory);
+    cells.reserve(image.width() / 4);
+    for (int x = 0; x <= image.width() - 4; x += 4) {
+        cells.push_back(findCell(image, x, y, flags));
     }
-};
-std::ostream &operator<<(std::ostream &stream, size sz) {
-    stream << sz.width << "x" << sz.height;
-    return stream;
+    return cells;
+}
+
+bool operator==(const CharData &a, const CharData &b) {
+    return a.codePoint == b.codePoint && a.fgColor == b.fgColor &&
+           a.bgColor == b.bgColor;
 }
 
 /**
- * @brief Wrapper around CImg<T>(const char*) constructor
- * that always returns a CImg image with 3 channels (RGB)
+ * @brief Renders the cells from begin to end of a row, setting both colors for
+ * the first one. Formatting is left as the last cell needs it.
  *
- * @param filename The file to construct a CImg object on
- * @return cimg_library::CImg<unsigned char> Constructed CImg RGB image
+ * @param out Where to append the escape sequences and characters
+ * @param cells The cells of the row
+ * @param begin Index of the first cell to render
+ * @param end Index after the last cell to render
+ * @param row Index of the row, for dithering
+ * @param flags
+ * @param palette Adaptive palette for --palette, or null
  */
-cimg_library::CImg<unsigned char> load_rgb_CImg(const char *const &filename) {
-    cimg_library::CImg<unsigned char> image(filename);
-    if (image.spectrum() == 1) {
-        // Greyscale. Just copy greyscale data to all channels
-        cimg_library::CImg<unsigned char> rgb_image(
-            image.width(), image.height(), image.depth(), 3);
-        for (unsigned int chn = 0; chn < 3; chn++) {
-            rgb_image.draw_image(0, 0, 0, chn, image);
+void emitCells(std::pmr::string &out, const std::pmr::vector<CharData> &cells,
+               int begin, int end, int row, const int &flags,
+               const Palette *palette) {
+    // With dithering, equal colors map to different palette entries depending
+    // on the column, so cells are compared by the entries they end up with.
+    const bool indexed = paletteMode(flags);
+    CharData lastCharData{};
+    int lastFg = -1;  // Palette entries of the last cell in 256-color mode
+    int lastBg = -1;
+    int repeat = 0;  // Pending copies of the last cell with FLAG_REP
+    for (int x = begin; x < end; x++) {
+        CharData charData = cells[x];
+        if ((flags & (FLAG_MODE_16 | FLAG_MODE_8)) && x != begin &&
+            charData.codePoint == 0x00a0) {
+            // Keep the foreground color of blank cells as it is
+            charData.fgColor = lastCharData.fgColor;
         }
-        return rgb_image;
+        int fg = -1;
+        int bg = -1;
+        if (indexed) {
+            fg = paletteIndex(flags, clamp_byte(charData.fgColor[0]),
+                              clamp_byte(charData.fgColor[1]),
+                              clamp_byte(charData.fgColor[2]), palette,
+                              ditherThreshold(flags, x, row, true));
+            bg = paletteIndex(flags, clamp_byte(charData.bgColor[0]),
+                              clamp_byte(charData.bgColor[1]),
+                              clamp_byte(charData.bgColor[2]), palette,
+                              ditherThreshold(flags, x, row, false));
+            if (x != begin && charData.codePoint == 0x00a0) fg = lastFg;
+        }
+        bool fgChanged =
+            indexed ? fg != lastFg : charData.fgColor != lastCharData.fgColor;
+        bool bgChanged =
+            indexed ? bg != lastBg : charData.bgColor != lastCharData.bgColor;
+        if (x == begin) fgChanged = bgChanged = true;
+        if ((flags & FLAG_REP) && !fgChanged && !bgChanged &&
+            charData.codePoint == lastCharData.codePoint) {
+            repeat++;
+            continue;
+        }
+        emitRepeat(out, lastCharData.codePoint, repeat);
+        repeat = 0;
+        if (bgChanged && indexed) {
+            emitPaletteColor(out, flags | FLAG_BG, bg);
+        } else if (bgChanged) {
+            emitTermColor(out, flags | FLAG_BG, charData.bgColor[0],
+                          charData.bgColor[1], charData.bgColor[2], palette,
+                          ditherThreshold(flags, x, row, false));
+        }
+        if (fgChanged && indexed) {
+            emitPaletteColor(out, flags | FLAG_FG, fg);
+        } else if (fgChanged) {
+            const size_t start = out.size();
+            emitTermColor(out, flags | FLAG_FG, charData.fgColor[0],
+                          charData.fgColor[1], charData.fgColor[2], palette,
+                          ditherThreshold(flags, x, row, true));
+            if (bgChanged && (flags & (FLAG_MODE_16 | FLAG_MODE_8))) {
+                // Basic colors are short enough to share one sequence
+                out[start - 1] = ';';
+                out.erase(start, 2);
+            }
+        }
+        emitCodepoint(out, charData.codePoint);
+        lastCharData = charData;
+        lastFg = fg;
+        lastBg = bg;
     }
-    return image;
+    emitRepeat(out, lastCharData.codePoint, repeat);
 }
 
-// Implements --help
-void printUsage() {
-    std::cerr << R"(
-Terminal Image Viewer v1.3
-usage: tiv [options] <image> [<image>...]
--0        : No block character adjustment, always use top half block char.
--2, --256 : Use 256-bit colors. Needed to display properly on macOS Terminal.
--c <num>  : Number of thumbnail columns in 'dir' mode (3 by default).
--d, --dir : Force 'dir' mode. Automatially selected for more than one input.
--f, --full: Force 'full' mode. Automatically selected for one input.
---help    : Display this help text.
--h <num>  : Set the maximum output height to <num> lines.
--w <num>  : Set the maximum output width to <num> characters.
--x        : Use new Unicode Teletext/legacy characters (experimental).)"
-              << std::endl;
+/**
+ * @brief Renders a single row of character cells, i.e. 8 pixel rows starting at
+ * y, including the trailing reset sequence and newline.
+ *
+ * @param image The image to render
+ * @param y The y coordinate of the top pixel row of the cell row
+ * @param flags
+ * @param palette Adaptive palette for --palette, or null
+ * @param memory Where to allocate the result
+ * @return The escape sequences and characters for the row
+ */
+std::pmr::string emitRow(
+    const cimg_library::CImg<unsigned char> &image, int y, const int &flags,
+    const Palette *palette = nullptr,
+    std::pmr::memory_resource *memory = std::pmr::get_default_resource()) {
+    std::pmr::string ret(memory);
+    // Room for two truecolor sequences and a character per cell
+    ret.reserve(image.width() / 4 * 44 + 8);
+    const std::pmr::vector<CharData> cells = findRow(image, y, flags, memory);
+    emitCells(ret, cells, 0, cells.size(), y / 8, flags, palette);
+    ret += "\x1b[0m\n";  // clear formatting until next batch
+    return ret;
 }
 
-enum Mode { AUTO, THUMBNAILS, FULL_SIZE };
+/**
+ * @brief Ordered queue of output chunks that a dedicated writer thread drains
+ * to stdout.
+ *
+ * Producers reserve sequence numbers up front and may publish the chunks in
+ * any order from any thread. The writer only writes the contiguous prefix of
+ * published chunks, gathering as many as are ready into a single writev()
+ * call. Slots are handed over with atomic sequence numbers only, so neither
+ * side ever takes a lock; when the ring is full, producers wait for the
+ * writer instead of growing it.
+ *
+ * Chunks are either ordinary strings, or strings allocated from a FrameArena
+ * that stays alive until they have been written.
+ */
+class OutputQueue {
+   public:
+    OutputQueue() : writer(&OutputQueue::run, this) {}
+    ~OutputQueue() {
+        drain();
+        // Wake the writer up with a sequence number it is never waiting for
+        Slot &slot = slots[written.load() % CAPACITY];
+        slot.seq.store(STOP, std::memory_order_release);
+        slot.seq.notify_one();
+        writer.join();
+    }
+
+    // Reserve count consecutive sequence numbers, returns the first one.
+    uint64_t reserve(uint64_t count = 1) { return reserved.fetch_add(count); }
 
-int main(int argc, char *argv[]) {
-    std::ios::sync_with_stdio(false);  // apparently makes printing faster
-    bool detectSize = true;
+    // Hand over the chunk for a previously reserved sequence number.
+    void publish(uint64_t seq, std::string chunk) {
+        Slot &slot = claim(seq);
+        slot.data = std::move(chunk);
+        slot.seq.store(seq, std::memory_order_release);
+        slot.seq.notify_one();
+    }
+    void publish(uint64_t seq, std::pmr::string chunk) {
+        Slot &slot = claim(seq);
+        // Constructed rather than assigned, to keep the chunk's allocator
+        slot.arenaData.emplace(std::move(chunk));
+        slot.seq.store(seq, std::memory_order_release);
+        slot.seq.notify_one();
+    }
+    void publish(uint64_t seq, const char *chunk) {
+        publish(seq, std::string(chunk));
+    }
 
-    // Fallback sizes when unsuccesful. Sizes are actually 1/4th of the actual
-    int maxWidth = 80;
-    int maxHeight = 24;
+    // Append a chunk after everything reserved so far.
+    void write(std::string chunk) { publish(reserve(), std::move(chunk)); }
+    void write(const char *chunk) { publish(reserve(), chunk); }
 
-    // Reading input
-    int8_t flags = 0;  // bitwise representation of flags,
-                       // see https://stackoverflow.com/a/14295472
-    Mode mode = AUTO;  // either THUMBNAIL or FULL_SIZE
-    int columns = 3;
+    // Whether everything reserved so far has been written.
+    bool idle() const {
+        return written.load(std::memory_order_acquire) >= reserved.load();
+    }
 
-    std::vector<std::string> file_names;
-    int ret = EX_OK;  // The return code for the program
+    // Total number of bytes written to stdout so far.
+    uint64_t bytesWritten() const { return totalBytes.load(); }
 
-    if (argc <= 1) {
-        printUsage();
-        return EX_USAGE;
+    // Measured rate at which the terminal accepts output in bytes per second,
+    // or 0 if nothing substantial has been written yet.
+    double drainRate() const { return rate.load(); }
+
+    // Block until everything reserved so far, or up to the given sequence
+    // number, has been written.
+    void drain() { drain(reserved.load()); }
+    void drain(uint64_t target) {
+        uint64_t done = written.load(std::memory_order_acquire);
+        while (done < target) {
+            written.wait(done);
+            done = written.load(std::memory_order_acquire);
+        }
     }
 
-    for (int i = 1; i < argc; i++) {
-        std::string arg(argv[i]);
-        if (arg == "-0") {
-            flags |= FLAG_NOOPT;
-        } else if (arg == "-c") {
-            if (i < argc - 1) {
-                columns = std::stoi(argv[++i]);
-            } else {
-                std::cerr << "Error: -c requires a number" << std::endl;
-                ret = EX_USAGE;
+   private:
+    static constexpr uint64_t CAPACITY = 256;
+    static constexpr uint64_t EMPTY = ~uint64_t(0);
+    static constexpr uint64_t STOP = EMPTY - 1;
+
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> seq{EMPTY};
+        std::string data;
+        std::optional<std::pmr::string> arenaData;
+
+        std::string_view chunk() const {
+            return arenaData ? std::string_view(*arenaData) : data;
+        }
+    };
+
+    std::array<Slot, CAPACITY> slots;
+    std::atomic<uint64_t> reserved{0};
+    std::atomic<uint64_t> written{0};
+    std::atomic<uint64_t> totalBytes{0};
+    std::atomic<double> rate{0};
+#ifdef _POSIX_VERSION
+    std::vector<iovec> iov;  // Only used by the writer, kept for its capacity
+#endif
+    std::thread writer;
+
+    // Wait until the slot for the sequence number is free.
+    Slot &claim(uint64_t seq) {
+        uint64_t done = written.load(std::memory_order_acquire);
+        while (seq >= done + CAPACITY) {  // ring is full, wait for the writer
+            written.wait(done);
+            done = written.load(std::memory_order_acquire);
+        }
+        return slots[seq % CAPACITY];
+    }
+
+    void run() {
+        uint64_t next = 0;
+        while (true) {
+            Slot &first = slots[next % CAPACITY];
+            uint64_t seq = first.seq.load(std::memory_order_acquire);
+            while (seq != next && seq != STOP) {
+                first.seq.wait(seq);
+                seq = first.seq.load(std::memory_order_acquire);
             }
-        } else if (arg == "-d" || arg == "--dir") {
-            mode = THUMBNAILS;
-        } else if (arg == "-f" || arg == "--full") {
-            mode = FULL_SIZE;
-        } else if (arg == "-w") {
-            if (i < argc - 1) {
-                maxWidth = 4 * std::stoi(argv[++i]), detectSize = false;
-            } else {
-                std::cerr << "Error: -w requires a number" << std::endl;
-                ret = EX_USAGE;
+            if (seq == STOP) return;
+
+            // Gather everything that is ready
+            uint64_t end = next + 1;
+            while (end < next + CAPACITY &&
+                   slots[end % CAPACITY].seq.load(std::memory_order_acquire) ==
+                       end) {
+                end++;
             }
-        } else if (arg == "-h") {
-            if (i < argc - 1)
-                maxHeight = 8 * std::stoi(argv[++i]), detectSize = false;
-            else
-                printUsage();  // people might confuse this with help
-        } else if (arg == "--256" || arg == "-2" || arg == "-256") {
-            flags |= FLAG_MODE_256;
-        } else if (arg == "--help" || arg == "-help") {
-            printUsage();
-        } else if (arg == "-x") {
-            flags |= FLAG_TELETEXT;
+            flush(next, end);
+            for (uint64_t i = next; i < end; i++) {
+                std::string().swap(slots[i % CAPACITY].data);
+                slots[i % CAPACITY].arenaData.reset();
+            }
+            next = end;
+            written.store(next, std::memory_order_release);
+            written.notify_all();
+        }
+    }
+
+    // Write the chunks in [begin, end) to stdout.
+    void flush(uint64_t begin, uint64_t end) {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t bytes = 0;
+        for (uint64_t i = begin; i < end; i++) {
+            bytes += slots[i % CAPACITY].chunk().size();
+        }
+#ifdef _POSIX_VERSION
+        iov.clear();
+        for (uint64_t i = begin; i < end; i++) {
+            std::string_view data = slots[i % CAPACITY].chunk();
+            if (!data.empty()) {
+                iov.push_back({const_cast<char *>(data.data()), data.size()});
+            }
+        }
+        size_t first = 0;
+        while (first < iov.size()) {
+            ssize_t n =
+                writev(STDOUT_FILENO, &iov[first],
+                       std::min<size_t>(iov.size() - first, IOV_MAX));
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    // Stdout was left non-blocking by some other program,
+                    // wait until the terminal catches up
+                    pollfd fd = {STDOUT_FILENO, POLLOUT, 0};
+                    poll(&fd, 1, -1);
+                    continue;
+                }
+                return;  // Nowhere to report this, stdout is gone
+            }
+            // Skip fully written chunks and adjust a partially written one
+            while (first < iov.size() &&
+                   static_cast<size_t>(n) >= iov[first].iov_len) {
+                n -= iov[first++].iov_len;
+            }
+            if (first < iov.size()) {
+                iov[first].iov_base =
+                    static_cast<char *>(iov[first].iov_base) + n;
+                iov[first].iov_len -= n;
+            }
+        }
+#else
+        for (uint64_t i = begin; i < end; i++) {
+            std::string_view data = slots[i % CAPACITY].chunk();
+            std::fwrite(data.data(), 1, data.size(), stdout);
+        }
+        std::fflush(stdout);
+#endif
+        totalBytes += bytes;
+        // Only larger batches tell us anything about the terminal
+        double seconds = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+        if (bytes >= 4096 && seconds > 0) {
+            double old = rate.load();
+            double current = bytes / seconds;
+            rate.store(old == 0 ? current : 0.7 * old + 0.3 * current);
+        }
+    }
+};
+
+// All output to stdout goes through this queue.
+OutputQueue &output() {
+    static OutputQueue queue;
+    return queue;
+}
+
+/**
+ * @brief Memory for the output of one frame, shared by all threads that
+ * render it, and released all at once.
+ *
+ * Allocation bumps an atomic offset into one buffer, and deallocation does
+ * nothing. What does not fit goes to the heap, and the next reset grows the
+ * buffer to fit it, so a run of similar frames only touches the heap for the
+ * first one.
+ */
+class FrameArena : public std::pmr::memory_resource {
+   public:
+    ~FrameArena() {
+        // The output queue outlives us, and may still hold our strings
+        output().drain();
+        releaseOverflow();
+    }
+
+    // Start over. Nothing allocated before may be in use anymore.
+    void reset() {
+        const size_t needed = used.load();
+        if (needed > buffer.size()) {
+            buffer = std::vector<std::byte>(needed + needed / 2);
+        }
+        releaseOverflow();
+        used = 0;
+    }
+
+   private:
+    std::vector<std::byte> buffer;
+    std::atomic<size_t> used{0};
+    std::mutex overflowMutex;
+    std::vector<std::tuple<void *, size_t, size_t>> overflow;
+
+    void *do_allocate(size_t bytes, size_t alignment) override {
+        const size_t offset = used.fetch_add(bytes + alignment - 1);
+        const uintptr_t base = reinterpret_cast<uintptr_t>(buffer.data());
+        const uintptr_t aligned =
+            (base + offset + alignment - 1) & ~(alignment - 1);
+        if (aligned + bytes <= base + buffer.size()) {
+            return reinterpret_cast<void *>(aligned);
+        }
+        void *pointer =
+            std::pmr::new_delete_resource()->allocate(bytes, alignment);
+        std::lock_guard<std::mutex> lock(overflowMutex);
+        overflow.emplace_back(pointer, bytes, alignment);
+        return pointer;
+    }
+    void releaseOverflow() {
+        for (auto [pointer, bytes, alignment] : overflow) {
+            std::pmr::new_delete_resource()->deallocate(pointer, bytes,
+                                                        alignment);
+        }
+        overflow.clear();
+    }
+
+    void do_deallocate(void *, size_t, size_t) override {}
+    bool do_is_equal(const std::pmr::memory_resource &other)
+        const noexcept override {
+        return this == &other;
+    }
+};
+
+/**
+ * @brief Switches to the arena for the next frame, and returns it.
+ *
+ * Two arenas take turns, so a frame can be rendered while the previous one is
+ * still being written. Before an arena is reused, everything reserved in the
+ * output queue while it was last in use is written. Only call this from the
+ * main thread.
+ */
+FrameArena &nextFrameArena() {
+    static std::array<FrameArena, 2> arenas;
+    static std::array<uint64_t, 2> fences = {0, 0};
+    static int current = 0;
+    fences[current] = output().reserve(0);
+    current ^= 1;
+    output().drain(fences[current]);
+    arenas[current].reset();
+    return arenas[current];
+}
+
+/**
+ * @brief The number of threads for parallel work: one per core, unless set
+ * with -j.
+ */
+unsigned int &threadCount() {
+    static unsigned int count =
+        std::max(1u, std::thread::hardware_concurrency());
+    return count;
+}
+
+// How urgent parallel work is, most urgent first
+enum Priority {
+    PRIORITY_VISIBLE,   // Output that is about to be shown
+    PRIORITY_NORMAL,
+    PRIORITY_PREFETCH,  // Work that is only needed later
+    PRIORITIES
+};
+
+class TaskGroup;
+
+/**
+ * @brief The threads that all parallel work runs on: threadCount() of them,
+ * counting the thread that waits for the work.
+ *
+ * Every worker has a queue of tasks per priority. New tasks go to the queue
+ * of the thread that creates them, and the thread takes them back from the
+ * end, while idle workers steal from the front of the other queues. The most
+ * urgent task is always taken first, wherever it is queued. Threads that
+ * wait for tasks run queued tasks meanwhile, so nested parallel loops share
+ * the same threads rather than adding more, and never deadlock. They only
+ * pick tasks at least as urgent as the ones they wait for, though.
+ */
+class Scheduler {
+   public:
+    struct Task {
+        std::function<void()> run;
+        TaskGroup *group;
+    };
+
+    static Scheduler &get() {
+        static Scheduler scheduler;
+        return scheduler;
+    }
+    ~Scheduler() {
+        {
+            std::lock_guard<std::mutex> lock(sleep);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &thread : threads) thread.join();
+    }
+
+    void push(Task task, Priority priority) {
+        Queue &queue = *queues[self];
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks[priority].items.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(sleep);
+            queued++;
+        }
+        wake.notify_one();
+    }
+
+    // Runs the most urgent queued task that is at least as urgent as limit,
+    // returns whether there was one.
+    bool runOne(Priority limit = PRIORITY_PREFETCH);
+
+   private:
+    // Tasks of one priority, taken from either end. The storage is only
+    // released with the scheduler, so steady work does not allocate.
+    struct Tasks {
+        std::vector<Task> items;
+        size_t head = 0;  // Items before it were taken from the front
+
+        bool empty() const { return head == items.size(); }
+    };
+
+    struct Queue {
+        std::mutex mutex;
+        std::array<Tasks, PRIORITIES> tasks;
+    };
+
+    // Queue 0 belongs to the threads that are no workers
+    Scheduler() : queues(threadCount()) {
+        for (auto &queue : queues) queue = std::make_unique<Queue>();
+        for (unsigned int i = 1; i < queues.size(); i++) {
+            threads.emplace_back(&Scheduler::work, this, i);
+        }
+    }
+
+    void work(unsigned int index) {
+        self = index;
+        while (true) {
+            if (runOne()) continue;
+            std::unique_lock<std::mutex> lock(sleep);
+            wake.wait(lock, [&] { return stopping || queued > 0; });
+            if (stopping) return;
+        }
+    }
+
+    std::optional<Task> take(Priority limit) {
+        if (queued == 0) return std::nullopt;
+        for (int priority = 0; priority <= limit; priority++) {
+            for (size_t i = 0; i < queues.size(); i++) {
+                Queue &queue = *queues[(self + i) % queues.size()];
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                Tasks &tasks = queue.tasks[priority];
+                if (tasks.empty()) continue;
+                // Our own newest task, or the oldest one of another thread
+                Task task = std::move(i == 0 ? tasks.items.back()
+                                             : tasks.items[tasks.head++]);
+                if (i == 0) tasks.items.pop_back();
+                if (tasks.empty()) {
+                    tasks.items.clear();
+                    tasks.head = 0;
+                }
+                queued--;
+                return task;
+            }
+        }
+        return std::nullopt;
+    }
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+    std::mutex sleep;  // Idle workers wait here for queued tasks
+    std::condition_variable wake;
+    std::atomic<int> queued{0};
+    bool stopping = false;
+    static thread_local unsigned int self;  // Queue of the current thread
+};
+
+thread_local unsigned int Scheduler::self = 0;
+
+/**
+ * @brief Tasks that run on the Scheduler with one priority, and are waited
+ * for and cancelled together.
+ */
+class TaskGroup {
+   public:
+    explicit TaskGroup(Priority priority = PRIORITY_NORMAL)
+        : priority(priority) {}
+    ~TaskGroup() {
+        cancel();
+        join();
+    }
+    TaskGroup(const TaskGroup &) = delete;
+    TaskGroup &operator=(const TaskGroup &) = delete;
+
+    void run(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending++;
+        }
+        Scheduler::get().push({std::move(task), this}, priority);
+    }
+
+    // Skips the tasks that have not started yet. Running tasks may check
+    // cancelled() to stop early.
+    void cancel() { stopped = true; }
+    bool cancelled() const { return stopped; }
+
+    /**
+     * @brief Waits for all tasks, running queued tasks of the same or a more
+     * urgent priority meanwhile.
+     * @throws The first exception that a task threw, which cancels the rest
+     */
+    void wait() {
+        join();
+        if (error) std::rethrow_exception(std::exchange(error, nullptr));
+    }
+
+   private:
+    friend class Scheduler;
+
+    void join() {
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (pending == 0) return;
+            }
+            // Less urgent work would hold up what we are waiting for
+            if (Scheduler::get().runOne(priority)) continue;
+            // All of our tasks are running, or none are left
+            std::unique_lock<std::mutex> lock(mutex);
+            done.wait(lock, [&] { return pending == 0; });
+        }
+    }
+
+    void finish(std::exception_ptr exception) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (exception && !error) {
+            error = exception;
+            stopped = true;
+        }
+        if (--pending == 0) done.notify_all();
+    }
+
+    Priority priority;
+    std::atomic<bool> stopped{false};
+    std::mutex mutex;
+    std::condition_variable done;
+    int pending = 0;
+    std::exception_ptr error;
+};
+
+bool Scheduler::runOne(Priority limit) {
+    std::optional<Task> task = take(limit);
+    if (!task) return false;
+    std::exception_ptr exception;
+    if (!task->group->cancelled()) {
+#if cimg_use_openmp
+        // CImg runs serially inside tasks, the tasks keep the cores busy
+        const int ompThreads = omp_get_max_threads();
+        omp_set_num_threads(1);
+#endif
+        try {
+            task->run();
+        } catch (...) {
+            exception = std::current_exception();
+        }
+#if cimg_use_openmp
+        omp_set_num_threads(ompThreads);
+#endif
+    }
+    task->group->finish(exception);
+    return true;
+}
+
+/**
+ * @brief Calls task(i) for every i in [0, count), spread over threadCount()
+ * threads of the Scheduler.
+ *
+ * Indices are handed out in increasing order, so the lowest unfinished index
+ * is always being worked on.
+ *
+ * @throws The first exception that a call threw, later indices are skipped
+ */
+template <typename Task>
+void parallelFor(int count, const Task &task,
+                 Priority priority = PRIORITY_NORMAL) {
+    const unsigned int threads = std::min<unsigned int>(threadCount(), count);
+    if (threads <= 1) {
+        for (int i = 0; i < count; i++) task(i);
+        return;
+    }
+    struct Loop {
+        const Task &task;
+        int count;
+        TaskGroup group;
+        std::atomic<int> next{0};
+    } loop{task, count, TaskGroup(priority)};
+    for (unsigned int i = 0; i < threads; i++) {
+        // A single pointer fits into std::function without allocating
+        loop.group.run([state = &loop] {
+            for (int i; !state->group.cancelled() &&
+                        (i = state->next++) < state->count;) {
+                state->task(i);
+            }
+        });
+    }
+    loop.group.wait();
+}
+
+/**
+ * @brief Computes a palette for the image with median cut.
+ *
+ * The 15-bit color histogram is built in parallel, one partial histogram per
+ * thread. Median cut then repeatedly splits the box of histogram bins with
+ * the largest weighted extent at the weighted median of its widest channel,
+ * in Oklab with FLAG_OKLAB. Each palette entry is the weighted average of its
+ * box, and every bin maps to the entry of its box, so mapping pixels needs no
+ * search.
+ *
+ * @param image The image, with 3 channels
+ * @param maxColors Maximum palette size, at most 256
+ * @param flags
+ * @return The palette
+ */
+Palette quantize(const cimg_library::CImg<unsigned char> &image,
+                 int maxColors, const int &flags) {
+    const int width = image.width();
+    const int height = image.height();
+    const int chunks = std::max(
+        1, std::min<int>(threadCount(), height / 16));
+    std::vector<std::vector<uint32_t>> partial(chunks,
+                                               std::vector<uint32_t>(32768));
+    parallelFor(chunks, [&](int chunk) {
+        uint32_t *histogram = partial[chunk].data();
+        for (int z = 0; z < image.depth(); z++) {
+            for (int y = chunk * height / chunks;
+                 y < (chunk + 1) * height / chunks; y++) {
+                const unsigned char *r = image.data(0, y, z, 0);
+                const unsigned char *g = image.data(0, y, z, 1);
+                const unsigned char *b = image.data(0, y, z, 2);
+                for (int x = 0; x < width; x++) {
+                    histogram[colorKey(r[x], g[x], b[x])]++;
+                }
+            }
+        }
+    });
+    std::vector<uint64_t> histogram(32768);
+    for (auto &counts : partial) {
+        for (int key = 0; key < 32768; key++) histogram[key] += counts[key];
+    }
+
+    std::vector<int> keys;
+    for (int key = 0; key < 32768; key++) {
+        if (histogram[key]) keys.push_back(key);
+    }
+    auto channel = [](int key, int c) { return (key >> (10 - 5 * c)) & 31; };
+    // Where the bins are for splitting boxes
+    std::vector<std::array<int, 3>> coords(32768);
+    for (int key : keys) {
+        coords[key] = flags & FLAG_OKLAB
+                          ? toOklab((key >> 10) << 3 | 4,
+                                    (key >> 5 & 31) << 3 | 4,
+                                    (key & 31) << 3 | 4)
+                          : std::array<int, 3>{channel(key, 0),
+                                               channel(key, 1),
+                                               channel(key, 2)};
+    }
+
+    struct Box {
+        size_t begin, end;
+        uint64_t weight;
+        int widest;  // Channel with the largest extent
+        int extent;
+    };
+    auto measure = [&](size_t begin, size_t end) {
+        Box box = {begin, end, 0, 0, 0};
+        int lo[3] = {std::numeric_limits<int>::max(),
+                     std::numeric_limits<int>::max(),
+                     std::numeric_limits<int>::max()};
+        int hi[3] = {std::numeric_limits<int>::min(),
+                     std::numeric_limits<int>::min(),
+                     std::numeric_limits<int>::min()};
+        for (size_t i = begin; i < end; i++) {
+            box.weight += histogram[keys[i]];
+            for (int c = 0; c < 3; c++) {
+                lo[c] = std::min(lo[c], coords[keys[i]][c]);
+                hi[c] = std::max(hi[c], coords[keys[i]][c]);
+            }
+        }
+        for (int c = 0; c < 3; c++) {
+            if (hi[c] - lo[c] > box.extent) {
+                box.extent = hi[c] - lo[c];
+                box.widest = c;
+            }
+        }
+        return box;
+    };
+
+    std::vector<Box> boxes;
+    if (!keys.empty()) boxes.push_back(measure(0, keys.size()));
+    while (static_cast<int>(boxes.size()) < maxColors) {
+        Box *best = nullptr;
+        for (Box &box : boxes) {
+            if (box.extent > 0 &&
+                (!best ||
+                 box.weight * box.extent > best->weight * best->extent)) {
+                best = &box;
+            }
+        }
+        if (!best) break;  // Every box is down to a single color
+
+        Box box = *best;
+        std::sort(keys.begin() + box.begin, keys.begin() + box.end,
+                  [&](int a, int b) {
+                      return coords[a][box.widest] < coords[b][box.widest];
+                  });
+        size_t split = box.begin + 1;
+        for (uint64_t sum = histogram[keys[box.begin]];
+             split < box.end - 1 && sum < box.weight / 2; split++) {
+            sum += histogram[keys[split]];
+        }
+        *best = measure(box.begin, split);
+        boxes.push_back(measure(split, box.end));
+    }
+
+    Palette palette;
+    palette.index.fill(0);
+    for (const Box &box : boxes) {
+        uint64_t sum[3] = {0, 0, 0};
+        for (size_t i = box.begin; i < box.end; i++) {
+            for (int c = 0; c < 3; c++) {
+                // Expand 5 to 8 bits so that black and white stay exact
+                int value = channel(keys[i], c);
+                sum[c] += histogram[keys[i]] * ((value << 3) | (value >> 2));
+            }
+            palette.index[keys[i]] = palette.colors.size();
+        }
+        palette.colors.push_back({static_cast<int>(sum[0] / box.weight),
+                                  static_cast<int>(sum[1] / box.weight),
+                                  static_cast<int>(sum[2] / box.weight)});
+    }
+    return palette;
+}
+
+/**
+ * @brief Maps every 15-bit color to the nearest palette entry, in Oklab with
+ * FLAG_OKLAB.
+ *
+ * quantize() only maps the colors that occur in the image. Character cells
+ * average pixels though, so any color may need an entry.
+ */
+void remapNearest(Palette &palette, const int &flags) {
+    std::vector<std::array<int, 3>> colors;
+    for (const std::array<int, 3> &color : palette.colors) {
+        colors.push_back(colorCoords(flags, color[0], color[1], color[2]));
+    }
+    parallelFor(32, [&](int r) {
+        for (int key = r << 10; key < (r + 1) << 10; key++) {
+            // Compare to the center of the bin
+            std::array<int, 3> color =
+                colorCoords(flags, (key >> 10) << 3 | 4,
+                            (key >> 5 & 31) << 3 | 4, (key & 31) << 3 | 4);
+            long best = std::numeric_limits<long>::max();
+            for (size_t i = 0; i < colors.size(); i++) {
+                long distance = coordsDistance(colors[i], color);
+                if (distance < best) {
+                    best = distance;
+                    palette.index[key] = i;
+                }
+            }
+        }
+    });
+}
+
+/**
+ * @brief Computes an adaptive palette for --palette.
+ *
+ * @param image The image, all frames of an animation are taken into account
+ * @param flags
+ * @return The palette for emitTermColor()
+ */
+Palette adaptivePalette(const cimg_library::CImg<unsigned char> &image,
+                        const int &flags) {
+    Palette palette = quantize(image, 256 - PALETTE_OFFSET, flags);
+    remapNearest(palette, flags);
+    return palette;
+}
+
+// Returns the escape sequence that makes the terminal use the palette, see
+// PALETTE_OFFSET.
+std::string paletteSequence(const Palette &palette) {
+    std::string osc = "\x1b]4";
+    for (size_t i = 0; i < palette.colors.size(); i++) {
+        osc += std::format(";{};rgb:{:02x}/{:02x}/{:02x}", PALETTE_OFFSET + i,
+                           palette.colors[i][0], palette.colors[i][1],
+                           palette.colors[i][2]);
+    }
+    return osc + "\x1b\\";
+}
+
+/**
+ * @brief Computes an adaptive palette for --palette and makes the terminal
+ * use it.
+ */
+Palette definePalette(const cimg_library::CImg<unsigned char> &image,
+                      const int &flags) {
+    Palette palette = adaptivePalette(image, flags);
+    output().write(paletteSequence(palette));
+    return palette;
+}
+
+/**
+ * @brief Encodes a band of 6 pixel rows as sixels.
+ *
+ * Each color used in the band becomes one run-length encoded line of sixels.
+ *
+ * @param image The image to encode
+ * @param palette The palette of the image
+ * @param y0 The top pixel row of the band
+ * @return The sixel data of the band, including the trailing line feed
+ */
+std::string encodeSixelBand(const cimg_library::CImg<unsigned char> &image,
+                            const Palette &palette, int y0) {
+    const int width = image.width();
+    const int height = std::min(6, image.height() - y0);
+    std::array<int, 256> slot;
+    slot.fill(-1);
+    std::vector<int> used;         // Palette entries in order of appearance
+    std::vector<uint8_t> sixels;   // One row of width sixels per used color
+    for (int row = 0; row < height; row++) {
+        const unsigned char *r = image.data(0, y0 + row, 0, 0);
+        const unsigned char *g = image.data(0, y0 + row, 0, 1);
+        const unsigned char *b = image.data(0, y0 + row, 0, 2);
+        for (int x = 0; x < width; x++) {
+            int color = palette.index[colorKey(r[x], g[x], b[x])];
+            if (slot[color] < 0) {
+                slot[color] = used.size();
+                used.push_back(color);
+                sixels.resize(used.size() * width);
+            }
+            sixels[slot[color] * width + x] |= 1 << row;
+        }
+    }
+
+    std::string out;
+    for (size_t i = 0; i < used.size(); i++) {
+        if (i) out += '$';  // Back to the start of the band
+        out += std::format("#{}", used[i]);
+        const uint8_t *line = &sixels[i * width];
+        int end = width;
+        while (end > 0 && line[end - 1] == 0) end--;
+        for (int x = 0; x < end;) {
+            int run = 1;
+            while (x + run < end && line[x + run] == line[x]) run++;
+            char sixel = static_cast<char>(63 + line[x]);
+            if (run > 3) {
+                out += std::format("!{}", run);
+                out += sixel;
+            } else {
+                out.append(run, sixel);
+            }
+            x += run;
+        }
+    }
+    out += '-';  // Next band
+    return out;
+}
+
+/**
+ * @brief Outputs the given image as sixel graphics at its full resolution.
+ *
+ * Bands of 6 pixel rows are encoded in parallel and written in order as
+ * soon as they are done.
+ *
+ * @param image The image to output
+ * @param flags
+ */
+void printSixel(const cimg_library::CImg<unsigned char> &image,
+                const int &flags) {
+    Palette palette = quantize(image, 256, flags);
+    std::string header = std::format("\x1bPq\"1;1;{};{}", image.width(),
+                                     image.height());
+    for (size_t i = 0; i < palette.colors.size(); i++) {
+        const auto &color = palette.colors[i];
+        header += std::format("#{};2;{};{};{}", i, (color[0] * 100 + 127) / 255,
+                              (color[1] * 100 + 127) / 255,
+                              (color[2] * 100 + 127) / 255);
+    }
+    const int bands = (image.height() + 5) / 6;
+    const uint64_t first = output().reserve(bands + 2);
+    output().publish(first, std::move(header));
+    auto encodeBand = [&](int band) {
+        output().publish(first + 1 + band,
+                         encodeSixelBand(image, palette, band * 6));
+    };
+    parallelFor(bands, encodeBand, PRIORITY_VISIBLE);
+    output().publish(first + 1 + bands, "\x1b\\\n");
+}
+
+// Returns the value of the environment variable, empty if not set.
+std::string getEnv(const char *name) {
+    const char *value = std::getenv(name);
+    return value ? value : "";
+}
+
+constexpr char BASE64_ALPHABET[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// The two base64 characters for each 12-bit value, so that 3 input bytes
+// take two lookups instead of four.
+constexpr auto BASE64_PAIRS = [] {
+    std::array<char, 2 * 4096> pairs{};
+    for (int i = 0; i < 4096; i++) {
+        pairs[2 * i] = BASE64_ALPHABET[i >> 6];
+        pairs[2 * i + 1] = BASE64_ALPHABET[i & 63];
+    }
+    return pairs;
+}();
+
+// Appends the base64 encoding of the given bytes to out.
+void base64Encode(const unsigned char *data, size_t size, std::string &out) {
+    size_t pos = out.size();
+    out.resize(pos + (size + 2) / 3 * 4);
+    char *dst = out.data() + pos;
+    size_t i = 0;
+    // Straight-line loop without branches or appends, the compiler unrolls
+    // and pipelines it well
+    for (; i + 3 <= size; i += 3, dst += 4) {
+        uint32_t v = data[i] << 16 | data[i + 1] << 8 | data[i + 2];
+        std::memcpy(dst, &BASE64_PAIRS[2 * (v >> 12)], 2);
+        std::memcpy(dst + 2, &BASE64_PAIRS[2 * (v & 4095)], 2);
+    }
+    if (i < size) {
+        uint32_t v = data[i] << 16 | (i + 1 < size ? data[i + 1] << 8 : 0);
+        dst[0] = BASE64_ALPHABET[v >> 18];
+        dst[1] = BASE64_ALPHABET[(v >> 12) & 63];
+        dst[2] = i + 1 < size ? BASE64_ALPHABET[(v >> 6) & 63] : '=';
+        dst[3] = '=';
+    }
+}
+
+/**
+ * @brief Base64 encodes a stream of bytes straight into the output queue.
+ *
+ * Only a few kilobytes of encoded data are held at any time, so neither the
+ * input nor its encoding ever needs to exist in full.
+ */
+class Base64Writer {
+   public:
+    void write(const unsigned char *data, size_t size) {
+        // Complete a group of 3 bytes left over from the last call
+        while (carrySize > 0 && carrySize < 3 && size > 0) {
+            carry[carrySize++] = *data++;
+            size--;
+        }
+        if (carrySize == 3) {
+            base64Encode(carry, 3, encoded);
+            carrySize = 0;
+        }
+        size_t whole = size / 3 * 3;
+        base64Encode(data, whole, encoded);
+        for (size_t i = whole; i < size; i++) carry[carrySize++] = data[i];
+        if (encoded.size() >= 65536) {
+            output().write(std::move(encoded));
+            encoded.clear();
+        }
+    }
+
+    // Writes out the rest, including padding.
+    void finish() {
+        base64Encode(carry, carrySize, encoded);
+        carrySize = 0;
+        output().write(std::move(encoded));
+        encoded.clear();
+    }
+
+   private:
+    std::string encoded;
+    unsigned char carry[3];
+    size_t carrySize = 0;
+};
+
+// Converts the planar CImg data to interleaved RGB, as graphics protocols
+// expect it.
+void interleaveRgb(const cimg_library::CImg<unsigned char> &image,
+                   unsigned char *out) {
+    const int width = image.width();
+    parallelFor(image.height(), [&](int y) {
+        const unsigned char *r = image.data(0, y, 0, 0);
+        const unsigned char *g = image.data(0, y, 0, 1);
+        const unsigned char *b = image.data(0, y, 0, 2);
+        unsigned char *row = out + static_cast<size_t>(y) * width * 3;
+        for (int x = 0; x < width; x++) {
+            row[3 * x] = r[x];
+            row[3 * x + 1] = g[x];
+            row[3 * x + 2] = b[x];
+        }
+    });
+}
+
+/**
+ * @brief Hands the pixels of the image to a local terminal without encoding
+ * them, through a POSIX shared memory object or a temporary file.
+ *
+ * The terminal removes the shared memory object or file after reading it.
+ *
+ * @param image The image to transfer
+ * @param control The control data of the transmit command
+ * @return The transmit command, or an empty string if neither worked
+ */
+std::string kittyLocalTransfer(const cimg_library::CImg<unsigned char> &image,
+                               const std::string &control) {
+#ifdef _POSIX_VERSION
+    static int counter = 0;
+    const size_t bytes =
+        static_cast<size_t>(image.width()) * image.height() * 3;
+    std::string name = std::format("/tiv-{}-{}", getpid(), counter++);
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    std::string medium = "t=s";
+    if (fd < 0) {
+        // The terminal only deletes files with this in their name
+        name = (std::filesystem::temp_directory_path() /
+                "tiv-tty-graphics-protocol-XXXXXX")
+                   .string();
+        fd = mkstemp(name.data());
+        medium = "t=t";
+    }
+    if (fd < 0) return "";
+
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, bytes) == 0) {
+        map = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        if (medium == "t=s") {
+            shm_unlink(name.c_str());
+        } else {
+            unlink(name.c_str());
+        }
+        return "";
+    }
+    interleaveRgb(image, static_cast<unsigned char *>(map));
+    munmap(map, bytes);
+
+    std::string command = "\x1b_G" + control + ',' + medium + ';';
+    base64Encode(reinterpret_cast<const unsigned char *>(name.data()),
+                 name.size(), command);
+    return command + "\x1b\\";
+#else
+    return "";
+#endif
+}
+
+// Bytes of images uploaded to the terminal after which an earlier upload may
+// have been evicted. Kitty keeps 320 MB, other terminals less.
+constexpr uint64_t KITTY_REUPLOAD_BYTES = 64 << 20;
+
+/**
+ * @brief Outputs the given image through the kitty graphics protocol.
+ *
+ * On a local terminal the pixels are passed through shared memory (or a
+ * temporary file), which skips encoding altogether. Remote terminals get
+ * base64 chunks, compressed with zlib when built with cimg_use_zlib; chunks
+ * are encoded in parallel and written in order as soon as they are done.
+ * Each distinct image is uploaded once, showing it again only places the
+ * already uploaded image. The terminal evicts images when it runs out of
+ * storage, and placing an evicted image shows nothing. Since we never read
+ * its answers, images are uploaded again once KITTY_REUPLOAD_BYTES of other
+ * images were uploaded after them.
+ *
+ * @param image The image to output
+ * @param cellWidth Width of a character cell in pixels
+ * @param cellHeight Height of a character cell in pixels
+ */
+void printKitty(const cimg_library::CImg<unsigned char> &image, int cellWidth,
+                int cellHeight) {
+    struct Key {
+        size_t hash;  // Of the pixels
+        int width;
+        int height;
+        auto operator<=>(const Key &) const = default;
+    };
+    struct Upload {
+        uint32_t id;
+        uint64_t uploadedAt;  // Value of total right after the upload
+    };
+    static std::map<Key, Upload> uploaded;
+    static uint64_t total = 0;  // Bytes the terminal stored for our uploads
+    // Image ids are shared by all programs on the terminal, start somewhere
+    // unlikely to collide
+    static uint32_t nextId = 0x10000 + std::random_device()() % 0x7fff0000;
+
+    const int columns = (image.width() + cellWidth - 1) / cellWidth;
+    const int rows = (image.height() + cellHeight - 1) / cellHeight;
+    // Don't move the cursor (C=1), we do that below; never answer (q=2)
+    const std::string placement =
+        std::format("c={},r={},C=1,q=2", columns, rows);
+    const std::string lines(rows, '\n');
+
+    const Key key = {std::hash<std::string_view>()(std::string_view(
+                         reinterpret_cast<const char *>(image.data()),
+                         image.size())),
+                     image.width(), image.height()};
+    auto found = uploaded.find(key);
+    if (found != uploaded.end() &&
+        total - found->second.uploadedAt < KITTY_REUPLOAD_BYTES) {
+        output().write(std::format("\x1b_Ga=p,i={},{}\x1b\\",
+                                   found->second.id, placement) +
+                       lines);
+        return;
+    }
+    // Transmitting under the same id again replaces the image
+    const uint32_t id = found != uploaded.end() ? found->second.id : nextId++;
+    // Terminals store 4 bytes per pixel
+    total += static_cast<uint64_t>(image.width()) * image.height() * 4;
+    uploaded[key] = {id, total};
+    const std::string control =
+        std::format("a=T,i={},f=24,s={},v={},{}", id, image.width(),
+                    image.height(), placement);
+
+    if (getEnv("SSH_CONNECTION").empty() && getEnv("SSH_TTY").empty()) {
+        std::string command = kittyLocalTransfer(image, control);
+        if (!command.empty()) {
+            output().write(command + lines);
+            return;
+        }
+    }
+
+    std::vector<unsigned char> data(static_cast<size_t>(image.width()) *
+                                    image.height() * 3);
+    interleaveRgb(image, data.data());
+    std::string compression;
+#ifdef cimg_use_zlib
+    uLongf packedSize = compressBound(data.size());
+    std::vector<unsigned char> packed(packedSize);
+    if (compress2(packed.data(), &packedSize, data.data(), data.size(),
+                  Z_BEST_SPEED) == Z_OK) {
+        packed.resize(packedSize);
+        data.swap(packed);
+        compression = ",o=z";
+    }
+#endif
+
+    // 3072 bytes make 4096 base64 characters, the maximum chunk size
+    constexpr size_t CHUNK = 3072;
+    const int chunks = std::max<int>(1, (data.size() + CHUNK - 1) / CHUNK);
+    const uint64_t first = output().reserve(chunks + 1);
+    auto encodeChunk = [&](int chunk) {
+        std::string command = chunk == 0 ? "\x1b_G" + control + compression +
+                                               ",t=d,m="
+                                         : "\x1b_Gm=";
+        command += chunk == chunks - 1 ? "0;" : "1;";
+        size_t offset = chunk * CHUNK;
+        base64Encode(data.data() + offset,
+                     std::min(CHUNK, data.size() - offset), command);
+        output().publish(first + chunk, command + "\x1b\\");
+    };
+    parallelFor(chunks, encodeChunk, PRIORITY_VISIBLE);
+    output().publish(first + chunks, lines);
+}
+
+constexpr auto CRC32_TABLE = [] {
+    std::array<uint32_t, 256> table{};
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        table[i] = c;
+    }
+    return table;
+}();
+
+uint32_t updateCrc32(uint32_t crc, const unsigned char *data, size_t size) {
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) {
+        crc = CRC32_TABLE[(crc ^ data[i]) & 255] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/**
+ * @brief Encodes the image as PNG, one row at a time.
+ *
+ * When built with cimg_use_zlib the image data is deflated, otherwise it goes
+ * into stored deflate blocks, which costs size but nearly no time.
+ *
+ * @param image The image to encode
+ * @param sink Called with each piece of the PNG file, in order
+ */
+template <typename Sink>
+void encodePng(const cimg_library::CImg<unsigned char> &image, Sink &&sink) {
+    auto chunk = [&](const char *type, const unsigned char *data,
+                     size_t size) {
+        unsigned char header[8] = {
+            static_cast<unsigned char>(size >> 24),
+            static_cast<unsigned char>(size >> 16),
+            static_cast<unsigned char>(size >> 8),
+            static_cast<unsigned char>(size),
+            static_cast<unsigned char>(type[0]),
+            static_cast<unsigned char>(type[1]),
+            static_cast<unsigned char>(type[2]),
+            static_cast<unsigned char>(type[3])};
+        uint32_t crc = updateCrc32(updateCrc32(0, header + 4, 4), data, size);
+        unsigned char trailer[4] = {
+            static_cast<unsigned char>(crc >> 24),
+            static_cast<unsigned char>(crc >> 16),
+            static_cast<unsigned char>(crc >> 8),
+            static_cast<unsigned char>(crc)};
+        sink(header, 8);
+        sink(data, size);
+        sink(trailer, 4);
+    };
+
+    const int width = image.width();
+    const int height = image.height();
+    static constexpr unsigned char SIGNATURE[] = {0x89, 'P',  'N',  'G',
+                                                  '\r', '\n', 0x1a, '\n'};
+    sink(SIGNATURE, 8);
+    // Size, 8 bits per channel, RGB, deflate, no interlacing
+    unsigned char ihdr[13] = {
+        static_cast<unsigned char>(width >> 24),
+        static_cast<unsigned char>(width >> 16),
+        static_cast<unsigned char>(width >> 8),
+        static_cast<unsigned char>(width),
+        static_cast<unsigned char>(height >> 24),
+        static_cast<unsigned char>(height >> 16),
+        static_cast<unsigned char>(height >> 8),
+        static_cast<unsigned char>(height),
+        8, 2, 0, 0, 0};
+    chunk("IHDR", ihdr, 13);
+
+    // Each row is a filter type byte (0 = none) followed by the pixels
+    std::vector<unsigned char> row(1 + 3 * width);
+    auto fillRow = [&](int y) {
+        row[0] = 0;
+        const unsigned char *r = image.data(0, y, 0, 0);
+        const unsigned char *g = image.data(0, y, 0, 1);
+        const unsigned char *b = image.data(0, y, 0, 2);
+        for (int x = 0; x < width; x++) {
+            row[1 + 3 * x] = r[x];
+            row[2 + 3 * x] = g[x];
+            row[3 + 3 * x] = b[x];
+        }
+    };
+
+#ifdef cimg_use_zlib
+    std::vector<unsigned char> buffer(65536);
+    z_stream stream = {};
+    deflateInit(&stream, Z_BEST_SPEED);
+    for (int y = 0; y <= height; y++) {
+        if (y < height) {
+            fillRow(y);
+            stream.next_in = row.data();
+            stream.avail_in = row.size();
+        }
+        int status;
+        do {
+            stream.next_out = buffer.data();
+            stream.avail_out = buffer.size();
+            status = deflate(&stream, y < height ? Z_NO_FLUSH : Z_FINISH);
+            size_t size = buffer.size() - stream.avail_out;
+            if (size) chunk("IDAT", buffer.data(), size);
+        } while (stream.avail_out == 0 && status != Z_STREAM_END);
+    }
+    deflateEnd(&stream);
+#else
+    // A zlib stream of stored blocks, each in its own IDAT chunk
+    static constexpr unsigned char ZLIB_HEADER[] = {0x78, 0x01};
+    chunk("IDAT", ZLIB_HEADER, 2);
+    const size_t total = static_cast<size_t>(height) * row.size();
+    size_t done = 0;
+    uint32_t adlerA = 1;
+    uint32_t adlerB = 0;
+    std::vector<unsigned char> block;
+    block.reserve(5 + 65535);
+    auto flushBlock = [&]() {
+        size_t size = block.size() - 5;
+        done += size;
+        block[0] = done == total ? 1 : 0;  // Final block flag, type stored
+        block[1] = size & 255;
+        block[2] = size >> 8;
+        block[3] = ~size & 255;
+        block[4] = (~size >> 8) & 255;
+        chunk("IDAT", block.data(), block.size());
+        block.assign(5, 0);
+    };
+    block.assign(5, 0);
+    for (int y = 0; y < height; y++) {
+        fillRow(y);
+        for (size_t i = 0; i < row.size();) {
+            size_t take = std::min(row.size() - i, 5 + 65535 - block.size());
+            block.insert(block.end(), row.begin() + i, row.begin() + i + take);
+            for (size_t k = i; k < i + take; k++) {
+                adlerA = (adlerA + row[k]) % 65521;
+                adlerB = (adlerB + adlerA) % 65521;
+            }
+            i += take;
+            if (block.size() == 5 + 65535) flushBlock();
+        }
+    }
+    if (block.size() > 5 || total == 0) flushBlock();
+    unsigned char adler[4] = {static_cast<unsigned char>(adlerB >> 8),
+                              static_cast<unsigned char>(adlerB),
+                              static_cast<unsigned char>(adlerA >> 8),
+                              static_cast<unsigned char>(adlerA)};
+    chunk("IDAT", adler, 4);
+#endif
+    chunk("IEND", nullptr, 0);
+}
+
+/**
+ * @brief Reads the pixel size of a PNG, GIF or JPEG file from its header.
+ *
+ * @param filename The file to look at
+ * @param width Receives the width
+ * @param height Receives the height
+ * @return Whether the size could be determined
+ */
+bool readImageSize(const std::string &filename, int &width, int &height) {
+    std::ifstream in(filename, std::ios::binary);
+    unsigned char header[26];
+    if (!in.read(reinterpret_cast<char *>(header), sizeof(header))) {
+        return false;
+    }
+    auto be16 = [](const unsigned char *p) { return p[0] << 8 | p[1]; };
+    if (header[0] == 0x89 && header[1] == 'P' && header[2] == 'N' &&
+        header[3] == 'G') {
+        // IHDR, up to 2^31 - 1 pixels each way
+        width = be16(header + 16) << 16 | be16(header + 18);
+        height = be16(header + 20) << 16 | be16(header + 22);
+        return width >= 0 && height >= 0;
+    }
+    if (header[0] == 'G' && header[1] == 'I' && header[2] == 'F') {
+        width = header[6] | header[7] << 8;
+        height = header[8] | header[9] << 8;
+        return true;
+    }
+    if (header[0] != 0xff || header[1] != 0xd8) return false;
+
+    // JPEG: walk the markers up to the start of frame
+    in.seekg(2);
+    for (int marker; in.get() == 0xff;) {
+        while ((marker = in.get()) == 0xff) {
+        }
+        unsigned char length[2];
+        if (!in.read(reinterpret_cast<char *>(length), 2)) return false;
+        // SOF0..SOF15, except DHT (c4), JPG (c8) and DAC (cc)
+        if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 &&
+            marker != 0xc8 && marker != 0xcc) {
+            unsigned char sof[5];
+            if (!in.read(reinterpret_cast<char *>(sof), 5)) return false;
+            height = be16(sof + 1);
+            width = be16(sof + 3);
+            return true;
+        }
+        in.seekg(be16(length) - 2, std::ios::cur);
+    }
+    return false;
+}
+
+// Files up to this size are sent to iTerm2 as they are, without decoding.
+constexpr std::uintmax_t ITERM_PASSTHROUGH_LIMIT = 2 << 20;
+
+/**
+ * @brief Sends the file to iTerm2 as it is, if it is small and in a format
+ * every iTerm2 can show (PNG, GIF or JPEG).
+ *
+ * The file is base64 encoded while it is read, it is never decoded.
+ *
+ * @param filename The file to show
+ * @param maxWidth Maximum width in pixels
+ * @param maxHeight Maximum height in pixels
+ * @param cellWidth Width of a character cell in pixels
+ * @param cellHeight Height of a character cell in pixels
+ * @return Whether the file was sent
+ */
+bool printITermFile(const std::string &filename, int maxWidth, int maxHeight,
+                    int cellWidth, int cellHeight) {
+    std::error_code error;
+    std::uintmax_t bytes = std::filesystem::file_size(filename, error);
+    int width, height;
+    if (error || bytes > ITERM_PASSTHROUGH_LIMIT ||
+        !readImageSize(filename, width, height) || width <= 0 ||
+        height <= 0) {
+        return false;
+    }
+    std::ifstream in(filename, std::ios::binary);
+    if (!in) return false;
+
+    if (width > maxWidth || height > maxHeight) {
+        double scale = std::min(maxWidth / static_cast<double>(width),
+                                maxHeight / static_cast<double>(height));
+        width = std::max(1, static_cast<int>(width * scale));
+        height = std::max(1, static_cast<int>(height * scale));
+    }
+    const int rows = (height + cellHeight - 1) / cellHeight;
+    output().write(std::format(
+        "\x1b]1337;File=inline=1;size={};width={};height={};"
+        "preserveAspectRatio=1:",
+        bytes, (width + cellWidth - 1) / cellWidth, rows));
+    Base64Writer writer;
+    // A multiple of 3, so no bytes need to be carried between blocks
+    std::vector<char> block(3 << 14);
+    while (in.read(block.data(), block.size()) || in.gcount() > 0) {
+        writer.write(reinterpret_cast<unsigned char *>(block.data()),
+                     in.gcount());
+    }
+    writer.finish();
+    output().write("\a\n");
+    return true;
+}
+
+/**
+ * @brief Outputs the given image as an iTerm2 inline image (OSC 1337).
+ *
+ * The image is encoded as PNG and base64 encoded on the fly, so no complete
+ * copy of either encoding is ever held.
+ *
+ * @param image The image to output
+ * @param cellWidth Width of a character cell in pixels
+ * @param cellHeight Height of a character cell in pixels
+ */
+void printITerm(const cimg_library::CImg<unsigned char> &image, int cellWidth,
+                int cellHeight) {
+    output().write(std::format(
+        "\x1b]1337;File=inline=1;width={};height={};preserveAspectRatio=1:",
+        (image.width() + cellWidth - 1) / cellWidth,
+        (image.height() + cellHeight - 1) / cellHeight));
+    Base64Writer writer;
+    encodePng(image, [&](const unsigned char *data, size_t size) {
+        writer.write(data, size);
+    });
+    writer.finish();
+    output().write("\a\n");
+}
+
+// Start and end of the document around --html output
+constexpr const char *HTML_HEADER =
+    "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><style>"
+    "pre{font-family:monospace;line-height:1}</style></head><body><pre>\n";
+constexpr const char *HTML_FOOTER = "</pre></body></html>\n";
+
+// Escapes text for the content of an HTML element.
+std::string htmlEscape(const std::string &text) {
+    std::string ret;
+    for (char c : text) {
+        if (c == '<') {
+            ret += "&lt;";
+        } else if (c == '>') {
+            ret += "&gt;";
+        } else if (c == '&') {
+            ret += "&amp;";
+        } else {
+            ret += c;
+        }
+    }
+    return ret;
+}
+
+// Returns a short CSS class name for the given index: a letter followed by as
+// few letters and digits as needed.
+std::string htmlClassName(size_t index) {
+    constexpr char chars[] =
+        "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    std::string name(1, chars[index % 52]);
+    for (index /= 52; index; index /= 62) name += chars[index % 62];
+    return name;
+}
+
+/**
+ * @brief Outputs the given image as part of the --html document.
+ *
+ * Every distinct pair of colors gets a short CSS class, most frequent first,
+ * and runs of cells sharing a class go into a single span. Classes are kept
+ * for the whole run and style blocks apply to the whole document, so each
+ * image only defines the pairs it adds.
+ *
+ * @param image The image to output.
+ * @param flags
+ */
+void printHtml(const cimg_library::CImg<unsigned char> &image,
+               const int &flags) {
+    const int rows = image.height() / 8;
+    const int columns = image.width() / 4;
+    if (rows <= 0 || columns <= 0) return;
+
+    std::vector<CharData> cells(rows * columns);
+    auto findCells = [&](int row) {
+        for (int column = 0; column < columns; column++) {
+            cells[row * columns + column] =
+                findCell(image, column * 4, row * 8, flags);
+        }
+    };
+    parallelFor(rows, findCells, PRIORITY_VISIBLE);
+
+    auto key = [](const CharData &cell) {
+        return static_cast<uint64_t>(cell.fgColor[0] << 16 |
+                                     cell.fgColor[1] << 8 | cell.fgColor[2])
+                   << 24 |
+               (cell.bgColor[0] << 16 | cell.bgColor[1] << 8 | cell.bgColor[2]);
+    };
+    static std::map<uint64_t, std::string> classes;
+    std::map<uint64_t, int> added;
+    for (const CharData &cell : cells) {
+        if (!classes.count(key(cell))) added[key(cell)]++;
+    }
+    if (!added.empty()) {
+        std::vector<std::pair<int, uint64_t>> order;
+        for (const auto &[pair, count] : added) {
+            order.emplace_back(-count, pair);
+        }
+        std::sort(order.begin(), order.end());
+        std::string style = "<style>";
+        for (const auto &[count, pair] : order) {
+            std::string name = htmlClassName(classes.size());
+            style += std::format(".{}{{color:#{:06x};background:#{:06x}}}",
+                                 name, pair >> 24, pair & 0xffffff);
+            classes[pair] = std::move(name);
+        }
+        output().write(style + "</style>");
+    }
+
+    const uint64_t first = output().reserve(rows);
+    auto emitLine = [&](int row) {
+        std::string line;
+        const CharData *span = nullptr;
+        for (int column = 0; column < columns; column++) {
+            const CharData &cell = cells[row * columns + column];
+            // The foreground color does not matter for blank cells
+            if (!span || (key(cell) != key(*span) &&
+                          (cell.codePoint != 0x00a0 ||
+                           cell.bgColor != span->bgColor))) {
+                if (span) line += "</span>";
+                line += "<span class=" + classes.at(key(cell)) + ">";
+                span = &cell;
+            }
+            emitCodepoint(line, cell.codePoint);
+        }
+        output().publish(first + row, line + "</span>\n");
+    };
+    parallelFor(rows, emitLine, PRIORITY_VISIBLE);
+}
+
+/**
+ * @brief Outputs the given image.
+ *
+ * Cell rows are rendered in parallel and handed to the output queue in
+ * order, so each row is written as soon as all rows above it are done and
+ * the top of the image shows up right away.
+ *
+ * @param image The image to output.
+ * @param flags
+ * @param cellWidth Width of a character cell in image pixels
+ * @param cellHeight Height of a character cell in image pixels
+ * @param palette Adaptive palette for --palette, or null
+ */
+void printImage(const cimg_library::CImg<unsigned char> &image,
+                const int &flags, int cellWidth, int cellHeight,
+                const Palette *palette = nullptr) {
+    if (flags & FLAG_HTML) {
+        printHtml(image, flags);
+        return;
+    }
+    if (flags & FLAG_SIXEL) {
+        printSixel(image, flags);
+        return;
+    }
+    if (flags & FLAG_KITTY) {
+        printKitty(image, cellWidth, cellHeight);
+        return;
+    }
+    if (flags & FLAG_ITERM) {
+        printITerm(image, cellWidth, cellHeight);
+        return;
+    }
+    const int rows = image.height() / 8;
+    if (rows <= 0) return;
+
+    FrameArena &arena = nextFrameArena();
+    const uint64_t first = output().reserve(rows);
+    auto render = [&](int row) {
+        output().publish(first + row,
+                         emitRow(image, row * 8, flags, palette, &arena));
+    };
+    parallelFor(rows, render, PRIORITY_VISIBLE);
+}
+
+/**
+ * @brief Outputs images of the same size side by side, with their names
+ * below. With diff, a last panel marks the cells that are not the same in
+ * all images in red, on a darkened copy of the first image.
+ *
+ * The cells of all images are found in parallel before any are written.
+ * Images too small for a single cell are compared pixel by pixel instead.
+ *
+ * @param images The images
+ * @param names Their names
+ * @param diff Whether to add the diff panel
+ * @param flags
+ * @return The number of cells that differ, or of pixels for images smaller
+ * than a cell
+ */
+int compareImages(const std::vector<cimg_library::CImg<unsigned char>> &images,
+                  const std::vector<std::string> &names, bool diff,
+                  const int &flags) {
+    const int count = images.size();
+    const int rows = images[0].height() / 8;
+    // The rows of cells of the first image, then those of the second...
+    std::vector<std::pmr::vector<CharData>> cells(count * rows);
+    auto findCells = [&](int i) {
+        cells[i] = findRow(images[i / rows], i % rows * 8, flags);
+    };
+    parallelFor(count * rows, findCells, PRIORITY_VISIBLE);
+
+    int differ = 0;
+    const bool noCells = rows == 0 || images[0].width() < 4;
+    if (diff && noCells) {
+        cimg_forXY(images[0], x, y) {
+            bool same = true;
+            for (int i = 1; i < count; i++) {
+                cimg_forC(images[0], c) {
+                    same &= images[i](x, y, 0, c) == images[0](x, y, 0, c);
+                }
+            }
+            differ += !same;
+        }
+    }
+    if (diff && !noCells) {
+        for (int row = 0; row < rows; row++) {
+            std::pmr::vector<CharData> marked = cells[row];
+            for (size_t x = 0; x < marked.size(); x++) {
+                bool same = true;
+                for (int i = 1; i < count; i++) {
+                    same &= cells[i * rows + row][x] == marked[x];
+                }
+                for (int c = 0; c < 3; c++) {
+                    marked[x].fgColor[c] = same ? marked[x].fgColor[c] / 3
+                                                : c == 0 ? 255 : 0;
+                    marked[x].bgColor[c] = same ? marked[x].bgColor[c] / 3
+                                                : c == 0 ? 255 : 0;
+                }
+                differ += !same;
+            }
+            cells.push_back(std::move(marked));
+        }
+    }
+
+    // The diff panel follows the images. Images less than a row high have no
+    // cells, only their names are shown.
+    const int panels = count + (diff ? 1 : 0);
+    for (int row = 0; row < rows; row++) {
+        std::pmr::string line;
+        for (int panel = 0; panel < panels; panel++) {
+            const std::pmr::vector<CharData> &panelCells =
+                cells[panel * rows + row];
+            emitCells(line, panelCells, 0, panelCells.size(), row, flags,
+                      nullptr);
+            line += panel < panels - 1 ? "\x1b[0m  " : "\x1b[0m\n";
+        }
+        output().publish(output().reserve(), std::move(line));
+    }
+    // Names below, cut to the width of the panels
+    const size_t width = images[0].width() / 4;
+    std::string labels;
+    for (int panel = 0; panel < panels; panel++) {
+        std::string label =
+            panel < count ? names[panel]
+                          : std::format("{} {} differ", differ,
+                                        noCells ? "pixels" : "cells");
+        label = label.substr(label.find_last_of('/') + 1);
+        label.resize(width, ' ');
+        labels += label + (panel < panels - 1 ? "  " : "\n");
+    }
+    output().write(labels);
+    return differ;
+}
+
+/**
+ * @brief Shows the cursor again while the program is stopped or terminated by
+ * a signal, for the lifetime of the object, and hides it once more when the
+ * program continues.
+ *
+ * Stdout is left blocking: the terminal is shared with the shell, which must
+ * not inherit a non-blocking one when we get killed. The writer measures how
+ * fast the terminal drains instead.
+ */
+class CursorSignals {
+   public:
+    CursorSignals() {
+#ifdef _POSIX_VERSION
+        struct sigaction action = {};
+        action.sa_handler = onSignal;
+        sigemptyset(&action.sa_mask);
+        for (size_t i = 0; i < SIGNALS.size(); i++) {
+            sigaction(SIGNALS[i], &action, &old[i]);
+        }
+#endif
+    }
+    ~CursorSignals() {
+        output().drain();
+#ifdef _POSIX_VERSION
+        for (size_t i = 0; i < SIGNALS.size(); i++) {
+            sigaction(SIGNALS[i], &old[i], nullptr);
+        }
+#endif
+    }
+
+   private:
+#ifdef _POSIX_VERSION
+    static constexpr std::array<int, 4> SIGNALS = {SIGTSTP, SIGCONT, SIGTERM,
+                                                   SIGHUP};
+    std::array<struct sigaction, 4> old;
+
+    // Only async-signal-safe calls in here
+    static void onSignal(int signal) {
+        constexpr char show[] = "\x1b[0m\x1b[?25h";
+        constexpr char hide[] = "\x1b[?25l";
+        if (signal == SIGCONT) {
+            [[maybe_unused]] ssize_t n =
+                write(STDOUT_FILENO, hide, sizeof(hide) - 1);
+            return;
+        }
+        [[maybe_unused]] ssize_t n =
+            write(STDOUT_FILENO, show, sizeof(show) - 1);
+        if (signal == SIGTSTP) {
+            raise(SIGSTOP);  // SIGCONT hides the cursor again
+            return;
+        }
+        // Terminate the way the signal would have without us
+        std::signal(signal, SIG_DFL);
+        raise(signal);
+    }
+#endif
+};
+
+volatile std::sig_atomic_t interrupted = 0;
+
+void onInterrupt(int) { interrupted = 1; }
+
+/**
+ * @brief Reads the frame delays from the graphic control extensions of a GIF
+ * file.
+ *
+ * @param filename The file to read
+ * @return The delay of each frame in milliseconds, empty if not a GIF file
+ */
+std::vector<int> readGifDelays(const std::string &filename) {
+    std::vector<int> delays;
+    std::ifstream in(filename, std::ios::binary);
+    unsigned char header[13];
+    if (!in.read(reinterpret_cast<char *>(header), 13) || header[0] != 'G' ||
+        header[1] != 'I' || header[2] != 'F') {
+        return delays;
+    }
+    auto skipColorTable = [&](int packed) {
+        if (packed & 0x80) in.ignore(3 << ((packed & 7) + 1));
+    };
+    auto skipSubBlocks = [&]() {
+        for (int length; (length = in.get()) > 0;) in.ignore(length);
+    };
+
+    skipColorTable(header[10]);
+    int delay = 0;
+    for (int block; (block = in.get()) != EOF && block != 0x3b;) {
+        if (block == 0x21) {  // Extension
+            if (in.get() == 0xf9) {
+                // Graphic control: size, flags, delay (2), transparency, end
+                unsigned char gce[6];
+                if (!in.read(reinterpret_cast<char *>(gce), 6)) break;
+                delay = gce[2] | (gce[3] << 8);
+            } else {
+                skipSubBlocks();
+            }
+        } else if (block == 0x2c) {  // Image descriptor
+            unsigned char descriptor[9];
+            if (!in.read(reinterpret_cast<char *>(descriptor), 9)) break;
+            skipColorTable(descriptor[8]);
+            in.get();  // LZW minimum code size
+            skipSubBlocks();
+            // Like browsers, treat tiny delays as the 100ms default
+            delays.push_back(delay < 2 ? 100 : delay * 10);
+            delay = 0;
+        } else {
+            break;
+        }
+    }
+    return delays;
+}
+
+/**
+ * @brief Plays the frames stacked along the z axis of the image in place.
+ *
+ * Frames are picked by wall clock time. A frame is only submitted once the
+ * previous one has been written completely, and it is chosen by the time it
+ * is expected to reach the screen at the measured drain rate of the terminal.
+ * A slow terminal (e.g. over SSH) thus skips stale frames instead of falling
+ * further and further behind, and output never queues up.
+ *
+ * @param frames The frames, one per z slice
+ * @param delays Delay of each frame in milliseconds
+ * @param flags
+ * @param sync How to mark the frames as synchronized updates
+ * @param cellWidth Width of a character cell in image pixels
+ * @param cellHeight Height of a character cell in image pixels
+ * @param palette Adaptive palette for --palette, or null
+ */
+void playAnimation(const cimg_library::CImg<unsigned char> &frames,
+                   const std::vector<int> &delays, const int &flags,
+                   SyncMode sync, int cellWidth, int cellHeight,
+                   const Palette *palette) {
+    const int count = frames.depth();
+    const bool pixels = flags & FLAG_PIXELS;
+    // Pixel graphics take up every line they touch, characters only cover
+    // whole cells, see printImage()
+    const int lines = pixels ? (frames.height() + cellHeight - 1) / cellHeight
+                             : frames.height() / cellHeight;
+    // Start time of each frame in ms, the last entry is the total duration
+    std::vector<double> start(count + 1, 0);
+    for (int i = 0; i < count; i++) {
+        start[i + 1] = start[i] + (i < static_cast<int>(delays.size())
+                                       ? delays[i]
+                                       : 100);
+    }
+
+    CursorSignals cursorSignals;
+    auto oldHandler = std::signal(SIGINT, onInterrupt);
+    output().write("\x1b[?25l");  // hide cursor
+    if (pixels) {
+        // Where the cursor ends up after a sixel image differs between
+        // terminals. Make room first and return to a saved position instead.
+        output().write(std::string(lines, '\n') +
+                       std::format("\x1b[{}A", lines) + "\x1b" "7");  // DECSC
+    }
+
+    // Every frame is copied here in turn, rather than into a new image
+    cimg_library::CImg<unsigned char> slice(frames.width(), frames.height(), 1,
+                                            frames.spectrum());
+    auto begin = std::chrono::steady_clock::now();
+    uint64_t frameStart = output().bytesWritten();
+    double frameBytes = 0;
+    int shown = -1;
+    while (!interrupted) {
+        if (!output().idle()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        if (shown >= 0) frameBytes = output().bytesWritten() - frameStart;
+
+        double elapsed = std::chrono::duration<double, std::milli>(
+                             std::chrono::steady_clock::now() - begin)
+                             .count();
+        if (shown == count - 1) {
+            // Keep the last frame up for its full delay
+            if (elapsed >= start[count]) break;
+            std::this_thread::sleep_for(
+                std::chrono::duration<double, std::milli>(
+                    std::min(start[count] - elapsed, 10.0)));
+            continue;
+        }
+        double rate = output().drainRate();
+        double due = elapsed + (rate > 0 ? frameBytes * 1000 / rate : 0);
+
+        // Skip all frames that would be stale by the time they are visible
+        int frame = shown + 1;
+        while (frame < count - 1 && start[frame + 1] <= due) frame++;
+        if (start[frame] > due) {
+            std::this_thread::sleep_for(
+                std::chrono::duration<double, std::milli>(
+                    std::min(start[frame] - due, 10.0)));
+            continue;
+        }
+
+        frameStart = output().bytesWritten();
+        output().write(SYNC_BEGIN[sync]);
+        if (pixels) {
+            output().write("\x1b" "8");  // DECRC
+            // Remove the last frame, but keep it around for reuse
+            if (flags & FLAG_KITTY) output().write("\x1b_Ga=d,d=c,q=2\x1b\\");
+        } else if (shown >= 0) {
+            output().write(std::format("\x1b[{}A", lines));
+        }
+        for (int c = 0; c < frames.spectrum(); c++) {
+            slice.draw_image(0, 0, 0, c, frames.get_shared_slice(frame, c));
+        }
+        printImage(slice, flags, cellWidth, cellHeight, palette);
+        output().write(SYNC_END[sync]);
+        shown = frame;
+    }
+
+    output().write("\x1b[0m\x1b[?25h");  // show cursor
+    std::signal(SIGINT, oldHandler);
+    interrupted = 0;
+}
+
+// Returns text as a JSON string literal.
+std::string jsonString(std::string_view text) {
+    std::string ret = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            ret += '\\';
+            ret += c;
+        } else if (c == '\n') {
+            ret += "\\n";
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            ret += std::format("\\u{:04x}", static_cast<int>(c));
+        } else {
+            ret += c;
+        }
+    }
+    return ret + '"';
+}
+
+/**
+ * @brief Parses the JSON string literal at pos, and moves pos past it.
+ *
+ * @return The string, or nothing if there is no valid string at pos
+ */
+std::optional<std::string> parseJsonString(std::string_view text,
+                                           size_t &pos) {
+    if (pos >= text.size() || text[pos] != '"') return std::nullopt;
+    std::string ret;
+    auto hex = [&](size_t at) {
+        int value = 0;
+        for (size_t i = at; i < at + 4; i++) {
+            if (i >= text.size() || !std::isxdigit(text[i])) return -1;
+            value = value * 16 + (std::isdigit(text[i])
+                                      ? text[i] - '0'
+                                      : std::tolower(text[i]) - 'a' + 10);
+        }
+        return value;
+    };
+    for (pos++; pos < text.size(); pos++) {
+        char c = text[pos];
+        if (c == '"') {
+            pos++;
+            return ret;
+        }
+        if (c != '\\') {
+            ret += c;
+            continue;
+        }
+        if (++pos >= text.size()) break;
+        switch (text[pos]) {
+            case 'b': ret += '\b'; break;
+            case 'f': ret += '\f'; break;
+            case 'n': ret += '\n'; break;
+            case 'r': ret += '\r'; break;
+            case 't': ret += '\t'; break;
+            case 'u': {
+                int codepoint = hex(pos + 1);
+                if (codepoint < 0) return std::nullopt;
+                pos += 4;
+                // Characters outside the BMP come as surrogate pairs
+                if (codepoint >= 0xd800 && codepoint < 0xdc00 &&
+                    text.substr(pos + 1, 2) == "\\u") {
+                    int low = hex(pos + 3);
+                    if (low >= 0xdc00 && low < 0xe000) {
+                        codepoint = 0x10000 + ((codepoint - 0xd800) << 10) +
+                                    (low - 0xdc00);
+                        pos += 6;
+                    }
+                }
+                emitCodepoint(ret, codepoint);
+                break;
+            }
+            default: ret += text[pos];  // \" \\ and \/
+        }
+    }
+    return std::nullopt;
+}
+
+/**
+ * @brief Renders the frames stacked along the z axis of the image once, into
+ * an asciicast v2 recording for --play or any other asciicast player.
+ *
+ * The first frame is recorded in full. Later frames only contain the cells
+ * that changed since the frame before, one span per row, reached with
+ * relative cursor movements so the recording also plays in place below a
+ * prompt. The cells of each frame are found in parallel.
+ *
+ * @param frames The frames, one per z slice
+ * @param delays Delay of each frame in milliseconds
+ * @param flags
+ * @param palette Adaptive palette for --palette, or null
+ * @param out Where to write the recording
+ */
+void recordAnimation(const cimg_library::CImg<unsigned char> &frames,
+                     const std::vector<int> &delays, const int &flags,
+                     const Palette *palette, std::ostream &out) {
+    const int rows = frames.height() / 8;
+    out << std::format(
+               "{{\"version\": 2, \"width\": {}, \"height\": {}, "
+               "\"timestamp\": {}}}",
+               frames.width() / 4, rows + 1, std::time(nullptr))
+        << '\n';
+    double time = 0;  // In ms
+    auto event = [&](std::string_view data) {
+        out << std::format("[{:.3f}, \"o\", ", time / 1000)
+            << jsonString(data) << "]\n";
+    };
+
+    cimg_library::CImg<unsigned char> slice(frames.width(), frames.height(), 1,
+                                            frames.spectrum());
+    std::vector<std::pmr::vector<CharData>> last(rows), cells(rows);
+    for (int frame = 0; frame < frames.depth(); frame++) {
+        for (int c = 0; c < frames.spectrum(); c++) {
+            slice.draw_image(0, 0, 0, c, frames.get_shared_slice(frame, c));
+        }
+        parallelFor(rows, [&](int row) {
+            cells[row] = findRow(slice, row * 8, flags);
+        });
+
+        std::pmr::string data;
+        if (frame == 0) {
+            data += "\x1b[?25l";  // hide cursor
+            if (palette) data += paletteSequence(*palette);
+            for (int row = 0; row < rows; row++) {
+                emitCells(data, cells[row], 0, cells[row].size(), row, flags,
+                          palette);
+                // Players expect the output of a terminal, after newline
+                // translation
+                data += "\x1b[0m\r\n";
+            }
+        } else {
+            int cursor = rows;  // Row the cursor is on
+            for (int row = 0; row < rows; row++) {
+                int begin = 0;
+                int end = cells[row].size();
+                while (begin < end && cells[row][begin] == last[row][begin]) {
+                    begin++;
+                }
+                while (end > begin &&
+                       cells[row][end - 1] == last[row][end - 1]) {
+                    end--;
+                }
+                if (begin == end) continue;
+                std::format_to(std::back_inserter(data), "\x1b[{}{}\x1b[{}G",
+                               std::abs(cursor - row), cursor > row ? 'A' : 'B',
+                               begin + 1);
+                emitCells(data, cells[row], begin, end, row, flags, palette);
+                data += "\x1b[0m";
+                cursor = row;
+            }
+            if (cursor < rows) {
+                std::format_to(std::back_inserter(data), "\x1b[{}B\r",
+                               rows - cursor);
+            }
+        }
+        if (!data.empty()) event(data);
+        std::swap(last, cells);
+        time += frame < static_cast<int>(delays.size()) ? delays[frame] : 100;
+    }
+    event(palette ? "\x1b[?25h\x1b]104\x1b\\" : "\x1b[?25h");  // show cursor
+}
+
+/**
+ * @brief Plays an asciicast v2 recording, e.g. one made with --record.
+ *
+ * Output events are written at their time. When the terminal falls behind,
+ * all events that are due by the time it has caught up are written at once,
+ * as they may depend on each other.
+ *
+ * @param filename The recording
+ * @return Whether the file is an asciicast v2 recording
+ */
+bool playCast(const std::string &filename) {
+    std::ifstream in(filename, std::ios::binary);
+    std::string line;
+    if (!std::getline(in, line) ||
+        line.find("\"version\": 2") == std::string::npos) {
+        return false;
+    }
+    // Time in ms and data of the output events
+    std::vector<std::pair<double, std::string>> events;
+    while (std::getline(in, line)) {
+        size_t pos = line.find('[');
+        if (pos == std::string::npos) continue;
+        char *end;
+        double time = std::strtod(line.c_str() + pos + 1, &end);
+        pos = line.find('"', end - line.c_str());
+        std::optional<std::string> type = parseJsonString(line, pos);
+        if (!type) return false;
+        pos = line.find('"', pos);
+        std::optional<std::string> data = parseJsonString(line, pos);
+        if (!data) return false;
+        if (*type == "o") events.emplace_back(time * 1000, std::move(*data));
+    }
+
+    CursorSignals cursorSignals;
+    auto oldHandler = std::signal(SIGINT, onInterrupt);
+    auto begin = std::chrono::steady_clock::now();
+    size_t next = 0;
+    bool palette = false;  // Whether the recording redefined colors
+    while (next < events.size() && !interrupted) {
+        double elapsed = std::chrono::duration<double, std::milli>(
+                             std::chrono::steady_clock::now() - begin)
+                             .count();
+        if (events[next].first > elapsed) {
+            std::this_thread::sleep_for(
+                std::chrono::duration<double, std::milli>(
+                    std::min(events[next].first - elapsed, 10.0)));
+            continue;
+        }
+        if (!output().idle()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        std::string batch;
+        for (; next < events.size() && events[next].first <= elapsed; next++) {
+            batch += events[next].second;
+            palette |= events[next].second.find("\x1b]4;") != std::string::npos;
+        }
+        output().write(batch);
+    }
+    if (interrupted) {
+        output().write(palette ? "\x1b[0m\x1b[?25h\x1b]104\x1b\\"
+                               : "\x1b[0m\x1b[?25h");
+    }
+    std::signal(SIGINT, oldHandler);
+    interrupted = 0;
+    return true;
+}
+
+struct size {
+    size(unsigned int in_width, unsigned int in_height)
+        : width(in_width), height(in_height) {}
+    explicit size(cimg_library::CImg<unsigned int> img)
+        : width(img.width()), height(img.height()) {}
+    unsigned int width;
+    unsigned int height;
+    size scaled(double scale) { return size(width * scale, height * scale); }
+    size fitted_within(size container) {
+        double scale = std::min(container.width / static_cast<double>(width),
+                                container.height / static_cast<double>(height));
+        return scaled(scale);
+    }
+    // Like fitted_within(), but only by whole ratios such as 1/3 or 2
+    size snapped_within(size container) {
+        if (width <= container.width && height <= container.height) {
+            unsigned int factor = std::min(container.width / width,
+                                           container.height / height);
+            return size(width * factor, height * factor);
+        }
+        unsigned int divisor =
+            std::max((width + container.width - 1) / container.width,
+                     (height + container.height - 1) / container.height);
+        return size(width / divisor, height / divisor);
+    }
+};
+std::ostream &operator<<(std::ostream &stream, size sz) {
+    stream << sz.width << "x" << sz.height;
+    return stream;
+}
+
+/**
+ * @brief Wrapper around CImg<T>(const char*) constructor
+ * that always returns a CImg image with 3 channels (RGB)
+ *
+ * @param filename The file to construct a CImg object on
+ * @return cimg_library::CImg<unsigned char> Constructed CImg RGB image
+ */
+cimg_library::CImg<unsigned char> load_rgb_CImg(const char *const &filename) {
+    cimg_library::CImg<unsigned char> image;
+    // CImg picks the format by extension and misses PNM magic numbers, as
+    // for archive members read through /dev/fd
+    char magic[2] = {};
+    if (!*cimg_library::cimg::split_filename(filename) &&
+        std::ifstream(filename, std::ios::binary).read(magic, 2) &&
+        magic[0] == 'P' && magic[1] >= '1' && magic[1] <= '6') {
+        image.load_pnm(filename);
+    } else {
+        image.load(filename);
+    }
+    if (image.spectrum() == 1) {
+        // Greyscale. Just copy greyscale data to all channels
+        cimg_library::CImg<unsigned char> rgb_image(
+            image.width(), image.height(), image.depth(), 3);
+        for (unsigned int chn = 0; chn < 3; chn++) {
+            rgb_image.draw_image(0, 0, 0, chn, image);
+        }
+        return rgb_image;
+    }
+    return image;
+}
+
+/**
+ * @brief Weights of a resampling filter for each output position along one
+ * axis, in fixed point.
+ */
+struct FilterBank {
+    static constexpr int PRECISION = 14;  // Fractional bits of the weights
+    int taps;                             // Weights per output position
+    std::vector<int> start;               // First input position used
+    std::vector<int32_t> weights;         // taps weights per output position
+};
+
+/**
+ * @brief Computes the weights for resampling inSize samples to outSize, with
+ * Catmull-Rom, or with the filter selected by FLAG_LANCZOS or FLAG_MITCHELL.
+ * When shrinking, the filter is widened to cover all input samples.
+ */
+FilterBank makeFilterBank(int inSize, int outSize, const int &flags) {
+    const double support = flags & FLAG_LANCZOS ? 3 : 2;
+    // Cubic filters after Mitchell and Netravali, with parameters B and C
+    const double b = flags & FLAG_MITCHELL ? 1 / 3.0 : 0;
+    const double c = flags & FLAG_MITCHELL ? 1 / 3.0 : 0.5;
+    auto kernel = [&](double x) {
+        x = std::abs(x);
+        if (flags & FLAG_LANCZOS) {
+            if (x < 1e-8) return 1.0;
+            if (x >= 3) return 0.0;
+            return 3 * std::sin(M_PI * x) * std::sin(M_PI * x / 3) /
+                   (M_PI * M_PI * x * x);
+        }
+        if (x < 1) {
+            return ((12 - 9 * b - 6 * c) * x * x * x +
+                    (-18 + 12 * b + 6 * c) * x * x + (6 - 2 * b)) /
+                   6;
+        }
+        if (x < 2) {
+            return ((-b - 6 * c) * x * x * x + (6 * b + 30 * c) * x * x +
+                    (-12 * b - 48 * c) * x + (8 * b + 24 * c)) /
+                   6;
+        }
+        return 0.0;
+    };
+
+    const double scale = static_cast<double>(inSize) / outSize;
+    const double filterScale = std::max(scale, 1.0);
+    const double radius = support * filterScale;
+    FilterBank bank;
+    bank.taps = std::min(inSize, 2 * static_cast<int>(std::ceil(radius)) + 1);
+    bank.start.resize(outSize);
+    bank.weights.assign(static_cast<size_t>(outSize) * bank.taps, 0);
+    std::vector<double> weights(bank.taps);
+    for (int i = 0; i < outSize; i++) {
+        const double center = (i + 0.5) * scale;
+        const int first = std::max(0, static_cast<int>(center - radius + 0.5));
+        const int last =
+            std::min(inSize, static_cast<int>(center + radius + 0.5));
+        // Every position uses the same number of taps, zero where unneeded
+        const int start = std::min(first, inSize - bank.taps);
+        double total = 0;
+        for (int k = 0; k < bank.taps; k++) {
+            const int j = start + k;
+            weights[k] = j >= first && j < last
+                             ? kernel((j - center + 0.5) / filterScale)
+                             : 0;
+            total += weights[k];
+        }
+        // Round the weights and give the rounding error to the largest one
+        int32_t *fixed = &bank.weights[static_cast<size_t>(i) * bank.taps];
+        int32_t sum = 0;
+        int largest = 0;
+        for (int k = 0; k < bank.taps; k++) {
+            fixed[k] = std::lround(weights[k] / total *
+                                   (1 << FilterBank::PRECISION));
+            sum += fixed[k];
+            if (fixed[k] > fixed[largest]) largest = k;
+        }
+        fixed[largest] += (1 << FilterBank::PRECISION) - sum;
+        bank.start[i] = start;
+    }
+    return bank;
+}
+
+/**
+ * @brief Resamples all frames and channels of the image in two separable
+ * passes, horizontally and then vertically, with the filter selected in the
+ * flags. Axes that keep their size are copied unfiltered.
+ *
+ * The weights are computed once per call, and the inner loops use integers
+ * only, so that the compiler can vectorize them.
+ *
+ * @param image The image to resample
+ * @param width The new width
+ * @param height The new height
+ * @param flags
+ * @return The resampled image
+ */
+template <typename T>
+cimg_library::CImg<T> resample(const cimg_library::CImg<T> &image, int width,
+                               int height, const int &flags) {
+    constexpr int32_t maxValue = std::numeric_limits<T>::max();
+    constexpr int32_t half = 1 << (FilterBank::PRECISION - 1);
+    const int planes = image.depth() * image.spectrum();
+    if (width == image.width() && height == image.height()) return image;
+
+    cimg_library::CImg<T> wide;
+    if (width == image.width()) {
+        wide.assign(image, true);  // Shared, not copied
+    } else {
+        const FilterBank bank = makeFilterBank(image.width(), width, flags);
+        wide.assign(width, image.height(), image.depth(), image.spectrum());
+        parallelFor(planes * image.height(), [&](int row) {
+            const T *in =
+                image.data() + static_cast<size_t>(row) * image.width();
+            T *out = wide.data() + static_cast<size_t>(row) * width;
+            for (int x = 0; x < width; x++) {
+                const T *source = in + bank.start[x];
+                const int32_t *weight =
+                    &bank.weights[static_cast<size_t>(x) * bank.taps];
+                int32_t sum = half;
+                for (int k = 0; k < bank.taps; k++) {
+                    sum += weight[k] * source[k];
+                }
+                out[x] = std::clamp(sum >> FilterBank::PRECISION, 0, maxValue);
+            }
+        });
+    }
+    if (height == image.height()) return wide;
+
+    const FilterBank bank = makeFilterBank(image.height(), height, flags);
+    cimg_library::CImg<T> result(width, height, image.depth(),
+                                 image.spectrum());
+    parallelFor(planes * height, [&](int row) {
+        const int plane = row / height;
+        const int y = row % height;
+        const T *in =
+            wide.data() +
+            (static_cast<size_t>(plane) * image.height() + bank.start[y]) *
+                width;
+        const int32_t *weight =
+            &bank.weights[static_cast<size_t>(y) * bank.taps];
+        // Whole rows at a time, which vectorizes well
+        std::vector<int32_t> sums(width, half);
+        for (int k = 0; k < bank.taps; k++, in += width) {
+            for (int x = 0; x < width; x++) sums[x] += weight[k] * in[x];
+        }
+        T *out = result.data() + static_cast<size_t>(row) * width;
+        for (int x = 0; x < width; x++) {
+            out[x] = std::clamp(sums[x] >> FilterBank::PRECISION, 0, maxValue);
+        }
+    });
+    return result;
+}
+
+/**
+ * @brief Shrinks the image by integer factors, averaging blocks of factorX by
+ * factorY samples with adds, and a shift for blocks of a power of two
+ * samples. Samples past the last whole block are left out.
+ *
+ * @param image The image to shrink
+ * @param factorX The horizontal factor
+ * @param factorY The vertical factor
+ * @param frames The number of frames to keep
+ * @param convert Converts a sample of the image to the result type
+ * @return The shrunk image
+ */
+template <typename U, typename T, typename Convert>
+cimg_library::CImg<U> decimate(const cimg_library::CImg<T> &image,
+                               int factorX, int factorY, int frames,
+                               const Convert &convert) {
+    cimg_library::CImg<U> result(image.width() / factorX,
+                                 image.height() / factorY, frames,
+                                 image.spectrum());
+    const uint64_t count = static_cast<uint64_t>(factorX) * factorY;
+    const int shift = std::has_single_bit(count) ? std::countr_zero(count) : -1;
+    // Output rows of all frames and channels
+    const int rows = result.size() / result.width();
+    parallelFor(rows, [&](int row) {
+        const int plane = row / result.height();
+        const int y = row % result.height();
+        // Skip the frames that are left out
+        const int source = plane % frames + plane / frames * image.depth();
+        const T *in =
+            image.data() +
+            (static_cast<size_t>(source) * image.height() + y * factorY) *
+                image.width();
+        std::vector<uint64_t> sums(result.width(), count / 2);
+        for (int dy = 0; dy < factorY; dy++, in += image.width()) {
+            for (int x = 0; x < result.width(); x++) {
+                for (int dx = 0; dx < factorX; dx++) {
+                    sums[x] += convert(in[x * factorX + dx]);
+                }
+            }
+        }
+        U *out = result.data() + static_cast<size_t>(row) * result.width();
+        if (shift >= 0) {
+            for (int x = 0; x < result.width(); x++) out[x] = sums[x] >> shift;
+        } else {
+            for (int x = 0; x < result.width(); x++) out[x] = sums[x] / count;
+        }
+    });
+    return result;
+}
+
+/**
+ * @brief Resizes the samples of the image.
+ *
+ * When shrinking, the image is first decimated by the integer part of the
+ * scale factor, straight from the source samples. That reads every sample
+ * just once, and leaves the resampler only a small image to work on, or
+ * nothing at all for integer ratios.
+ *
+ * @param image The image to resize
+ * @param width The new width
+ * @param height The new height
+ * @param depth The number of frames to keep, or -100 to keep all
+ * @param flags
+ * @param convert Converts a sample of the image to the result type
+ * @return The resized image
+ */
+template <typename U, typename T, typename Convert>
+cimg_library::CImg<U> resizeSamples(const cimg_library::CImg<T> &image,
+                                    int width, int height, int depth,
+                                    const int &flags, const Convert &convert) {
+    const int frames =
+        depth < 0 ? image.depth() : std::min(depth, image.depth());
+    cimg_library::CImg<U> result =
+        decimate<U>(image, std::max(1, image.width() / width),
+                    std::max(1, image.height() / height), frames, convert);
+    return resample(result, width, height, flags);
+}
+
+/**
+ * @brief Resizes the image in linear light, on 16-bit values.
+ *
+ * @param image The image to resize
+ * @param width The new width
+ * @param height The new height
+ * @param depth The number of frames to keep, or -100 to keep all
+ * @param flags
+ * @param toLinear Converts a sample of the image to 16-bit linear light
+ * @return The resized image in sRGB
+ */
+template <typename T, typename ToLinear>
+cimg_library::CImg<unsigned char> resizeLinear(
+    const cimg_library::CImg<T> &image, int width, int height, int depth,
+    const int &flags, const ToLinear &toLinear) {
+    cimg_library::CImg<uint16_t> linear = resizeSamples<uint16_t>(
+        image, width, height, depth, flags, toLinear);
+
+    cimg_library::CImg<unsigned char> result(linear.width(), linear.height(),
+                                             linear.depth(), linear.spectrum());
+    const std::array<uint8_t, 65536> &toSrgb = linearToSrgb();
+    for (size_t i = 0; i < linear.size(); i++) result[i] = toSrgb[linear[i]];
+    return result;
+}
+
+/**
+ * @brief Resizes the image with the filter selected in the flags, in linear
+ * light with FLAG_LINEAR.
+ *
+ * @param image The image to resize in place
+ * @param width The new width
+ * @param height The new height
+ * @param depth The number of frames to keep, or -100 to keep all
+ * @param flags
+ */
+void resizeImage(cimg_library::CImg<unsigned char> &image, int width,
+                 int height, int depth, const int &flags) {
+    if (width <= 0 || height <= 0) {
+        image.resize(width, height, depth, -100, 5);
+        return;
+    }
+    if (!(flags & FLAG_LINEAR)) {
+        image = resizeSamples<unsigned char>(
+            image, width, height, depth, flags,
+            [](unsigned char value) { return value; });
+        return;
+    }
+    const std::array<uint16_t, 256> &toLinear = srgbToLinear();
+    image = resizeLinear(image, width, height, depth, flags,
+                         [&](unsigned char value) { return toLinear[value]; });
+}
+
+// How the samples of an image file are stored
+enum SampleFormat {
+    SAMPLES_8BIT,
+    SAMPLES_16BIT,           // Integers, usually sRGB encoded
+    SAMPLES_16BIT_LINEAR,    // Integers in linear light, as in scientific TIFF
+    SAMPLES_FLOAT,           // Linear light, may exceed 1
+    SAMPLES_FLOAT_EXTERNAL,  // Same, but CImg cannot load it
+};
+
+/**
+ * @brief Determines the sample format of a PNG, PNM, PFM, TIFF, OpenEXR or
+ * Radiance HDR file from its header. Anything else counts as 8 bits.
+ *
+ * TIFF files with more than 8 bits per sample mostly come from cameras and
+ * instruments that record linear light, so they are taken to be linear.
+ *
+ * @param filename The file to check
+ * @param[out] maxValue The largest integer sample value, e.g. 1023 for a
+ * 10-bit PNM file, if not null
+ */
+SampleFormat readSampleFormat(const std::string &filename,
+                              int *maxValue = nullptr) {
+    int max = 255;
+    if (!maxValue) maxValue = &max;
+    std::ifstream in(filename, std::ios::binary);
+    unsigned char header[26] = {0};
+    in.read(reinterpret_cast<char *>(header), sizeof(header));
+    in.clear();
+    if (header[0] == 0x89 && header[1] == 'P' && header[2] == 'N' &&
+        header[3] == 'G') {
+        *maxValue = header[24] == 16 ? 65535 : 255;
+        return header[24] == 16 ? SAMPLES_16BIT : SAMPLES_8BIT;
+    }
+    if (header[0] == 'P' && (header[1] == 'F' || header[1] == 'f')) {
+        return SAMPLES_FLOAT;
+    }
+    if (header[0] == 'P' && (header[1] == '5' || header[1] == '6')) {
+        // Width, height and maximum value, possibly with comments in between
+        in.seekg(2);
+        int values[3];
+        for (int &value : values) {
+            while (in >> std::ws && in.peek() == '#') {
+                in.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+            }
+            in >> value;
+        }
+        if (!in || values[2] <= 255) return SAMPLES_8BIT;
+        *maxValue = std::min(values[2], 65535);
+        return SAMPLES_16BIT;
+    }
+    if (std::memcmp(header, "\x76\x2f\x31\x01", 4) == 0 ||
+        std::memcmp(header, "#?RADIANCE", 10) == 0 ||
+        std::memcmp(header, "#?RGBE", 6) == 0) {
+#ifdef cimg_use_openexr
+        if (header[0] == 0x76) return SAMPLES_FLOAT;
+#endif
+        return SAMPLES_FLOAT_EXTERNAL;
+    }
+    const bool little = std::memcmp(header, "II*\0", 4) == 0;
+    if (!little && std::memcmp(header, "MM\0*", 4) != 0) return SAMPLES_8BIT;
+
+    // TIFF: look for BitsPerSample and SampleFormat in the first directory
+    auto read = [&](std::streamoff offset, int size) {
+        unsigned char bytes[4] = {0};
+        in.seekg(offset);
+        in.read(reinterpret_cast<char *>(bytes), size);
+        uint32_t value = 0;
+        for (int i = 0; i < size; i++) {
+            value |= static_cast<uint32_t>(bytes[i])
+                     << 8 * (little ? i : size - 1 - i);
+        }
+        return value;
+    };
+    const uint32_t directory = read(4, 4);
+    const int entries = read(directory, 2);
+    uint32_t bits = 8;
+    uint32_t format = 1;  // Unsigned integers
+    for (int i = 0; i < entries && in; i++) {
+        const std::streamoff entry = directory + 2 + 12 * i;
+        const uint32_t tag = read(entry, 2);
+        if (tag != 258 && tag != 339) continue;
+        // One value is stored in place, more at the given offset
+        uint32_t value = read(entry + 4, 4) == 1 ? read(entry + 8, 2)
+                                                 : read(read(entry + 8, 4), 2);
+        (tag == 258 ? bits : format) = value;
+    }
+    if (format == 3) return SAMPLES_FLOAT;
+    if (bits <= 8) return SAMPLES_8BIT;
+    *maxValue = (1 << std::min<uint32_t>(bits, 16)) - 1;
+    return SAMPLES_16BIT_LINEAR;
+}
+
+/**
+ * @brief Quotes the text for use as a single word in a POSIX shell command.
+ */
+std::string shellQuote(const std::string &text) {
+    std::string quoted = "'";
+    for (char c : text) quoted += c == '\'' ? "'\\''" : std::string(1, c);
+    return quoted + "'";
+}
+
+/**
+ * @brief Loads a 16-bit or floating point image without losing precision.
+ *
+ * @param filename The file to load
+ * @param format Its sample format, see readSampleFormat()
+ * @param maxValue The largest integer sample value, see readSampleFormat()
+ * @return The samples, scaled to 0 to 65535 for integer images and as they
+ * are for floating point images
+ */
+cimg_library::CImg<float> loadHighDepth(const std::string &filename,
+                                        SampleFormat format, int maxValue) {
+    cimg_library::CImg<float> image;
+    if (format == SAMPLES_FLOAT_EXTERNAL) {
+#ifdef _POSIX_VERSION
+        // ImageMagick keeps values above 1 in PFM
+        std::FILE *pipe = popen(
+            ("convert " + shellQuote(filename) + " pfm:- 2>/dev/null").c_str(),
+            "r");
+        if (pipe) {
+            try {
+                image.load_pfm(pipe);
+            } catch (cimg_library::CImgException &e) {
+                image.assign();
+            }
+            pclose(pipe);
+        }
+#endif
+        if (image.is_empty()) {
+            throw cimg_library::CImgIOException(
+                "Cannot load floating point image");
+        }
+    } else {
+        image.load(filename.c_str());
+        // E.g. 10- and 12-bit images, which would be nearly black otherwise
+        if (format != SAMPLES_FLOAT && maxValue < 65535) {
+            image *= 65535.0f / maxValue;
+        }
+    }
+    if (image.spectrum() == 1) image.resize(-100, -100, -100, 3, 1);
+    return image;
+}
+
+/**
+ * @brief Tone maps high bit depth samples to 16-bit linear light.
+ *
+ * 16-bit integer samples are sRGB decoded through a table first, unless they
+ * are linear already. After the
+ * exposure, the extended Reinhard operator with the brightest sample as white
+ * point compresses highlights: it leaves images that fit into the range alone
+ * and maps the brightest sample to white otherwise.
+ */
+class ToneMap {
+   public:
+    ToneMap(const cimg_library::CImg<float> &image, SampleFormat format,
+            float exposure)
+        // Linear integer samples are scaled to 0 to 1 along with the exposure
+        : exposure(format == SAMPLES_16BIT_LINEAR ? exposure / 65535
+                                                  : exposure) {
+        if (format == SAMPLES_16BIT) {
+            decode.resize(65536);
+            for (int i = 0; i < 65536; i++) {
+                double v = i / 65535.0;
+                decode[i] = v <= 0.04045 ? v / 12.92
+                                         : std::pow((v + 0.055) / 1.055, 2.4);
+            }
+        }
+        float white = std::max(1.0f, linear(image.max()));
+        inverseWhite2 = 1 / (white * white);
+    }
+
+    uint16_t operator()(float sample) const {
+        float v = linear(sample);
+        v = v * (1 + v * inverseWhite2) / (1 + v);
+        return std::min(v, 1.0f) * 65535 + 0.5f;
+    }
+
+   private:
+    float linear(float sample) const {
+        if (!decode.empty()) {
+            sample = decode[std::clamp(static_cast<int>(sample), 0, 65535)];
+        }
+        return std::max(sample, 0.0f) * exposure;
+    }
+
+    std::vector<float> decode;
+    float exposure;
+    float inverseWhite2;
+};
+
+// Limits for decoding images, 0 for none
+struct Budget {
+    uint64_t maxPixels = 0;  // Pixels of all frames together
+    uint64_t maxMemory = 0;  // Bytes, see estimateMemory()
+};
+
+/**
+ * @brief Estimates the memory needed to load an image, which is about twice
+ * its decoded size: CImg converts most images once after decoding.
+ */
+uint64_t estimateMemory(uint64_t pixels, SampleFormat format) {
+    return pixels * (format == SAMPLES_8BIT ? 3 : 3 * sizeof(float)) * 2;
+}
+
+/**
+ * @brief Reads the size of a PNG, GIF, JPEG, PNM, PFM, TIFF or BMP image from
+ * its header.
+ *
+ * @return Whether the size is known
+ */
+bool readAnyImageSize(const std::string &filename, int &width, int &height) {
+    if (readImageSize(filename, width, height)) return true;
+    std::ifstream in(filename, std::ios::binary);
+    unsigned char header[26] = {0};
+    in.read(reinterpret_cast<char *>(header), sizeof(header));
+    in.clear();
+    if (header[0] == 'P' && header[1] != 0 &&
+        std::strchr("123456Ff", header[1])) {
+        in.seekg(2);
+        for (int *value : {&width, &height}) {
+            while (in >> std::ws && in.peek() == '#') {
+                in.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+            }
+            in >> *value;
+        }
+        return static_cast<bool>(in);
+    }
+    if (header[0] == 'B' && header[1] == 'M') {
+        width = header[18] | header[19] << 8 | header[20] << 16 |
+                header[21] << 24;
+        height = std::abs(static_cast<int32_t>(
+            header[22] | header[23] << 8 | header[24] << 16 |
+            static_cast<uint32_t>(header[25]) << 24));
+        return true;
+    }
+    const bool little = std::memcmp(header, "II*\0", 4) == 0;
+    if (!little && std::memcmp(header, "MM\0*", 4) != 0) return false;
+
+    // TIFF: ImageWidth and ImageLength in the first directory
+    auto read = [&](std::streamoff offset, int size) {
+        unsigned char bytes[4] = {0};
+        in.seekg(offset);
+        in.read(reinterpret_cast<char *>(bytes), size);
+        uint32_t value = 0;
+        for (int i = 0; i < size; i++) {
+            value |= static_cast<uint32_t>(bytes[i])
+                     << 8 * (little ? i : size - 1 - i);
+        }
+        return value;
+    };
+    const uint32_t directory = read(4, 4);
+    const int entries = read(directory, 2);
+    width = height = -1;
+    for (int i = 0; i < entries && in; i++) {
+        const std::streamoff entry = directory + 2 + 12 * i;
+        const uint32_t tag = read(entry, 2);
+        if (tag != 256 && tag != 257) continue;
+        // SHORT (3) or LONG (4)
+        const uint32_t value =
+            read(entry + 8, read(entry + 2, 2) == 3 ? 2 : 4);
+        (tag == 256 ? width : height) = std::min<uint32_t>(value, INT32_MAX);
+    }
+    return in && width >= 0 && height >= 0;
+}
+
+/**
+ * @brief Reads the header of a binary PGM or PPM file, up to the samples.
+ *
+ * @param file The file, a pipe works as well
+ * @param[out] width
+ * @param[out] height
+ * @param[out] maxValue The largest sample value
+ * @param[out] channels 1 for PGM, 3 for PPM
+ * @return Whether this is such a file
+ */
+bool readPnmHeader(std::FILE *file, int &width, int &height, int &maxValue,
+                   int &channels) {
+    if (std::fgetc(file) != 'P') return false;
+    const int type = std::fgetc(file);
+    if (type != '5' && type != '6') return false;
+    int values[3];  // Width, height and maximum value
+    for (int &value : values) {
+        int c;
+        // Whitespace and comments
+        while (std::isspace(c = std::fgetc(file)) || c == '#') {
+            while (c == '#' && (c = std::fgetc(file)) != EOF && c != '\n') {
+            }
+        }
+        std::ungetc(c, file);
+        if (std::fscanf(file, "%d", &value) != 1) return false;
+    }
+    std::fgetc(file);  // The single whitespace before the samples
+    width = values[0];
+    height = values[1];
+    maxValue = values[2];
+    channels = type == '6' ? 3 : 1;
+    return width > 0 && height > 0 && maxValue > 0 && maxValue <= 65535;
+}
+
+/**
+ * @brief Reads a binary PGM or PPM file at a fraction of its size, averaging
+ * blocks of divisor by divisor pixels while streaming through the rows, so
+ * the full image is never in memory.
+ *
+ * @return The samples scaled to 16 bits, empty if the file is not a binary
+ * PGM or PPM file
+ */
+cimg_library::CImg<float> loadPnmReduced(const std::string &filename,
+                                         int divisor) {
+    std::unique_ptr<std::FILE, int (*)(std::FILE *)> file(
+        std::fopen(filename.c_str(), "rb"), std::fclose);
+    int width, height, maxValue, channels;
+    if (!file ||
+        !readPnmHeader(file.get(), width, height, maxValue, channels)) {
+        return {};
+    }
+    const int bytes = maxValue > 255 ? 2 : 1;
+    const int outWidth = std::max(1, width / divisor);
+    const int outHeight = std::max(1, height / divisor);
+    const int blockWidth = std::min(divisor, width);
+    const int blockHeight = std::min(divisor, height);
+
+    cimg_library::CImg<float> image(outWidth, outHeight, 1, 3);
+    std::vector<unsigned char> row(static_cast<size_t>(width) * channels *
+                                   bytes);
+    std::vector<double> sums(static_cast<size_t>(outWidth) * channels);
+    const double scale = 65535.0 / maxValue / (blockWidth * blockHeight);
+    for (int y = 0; y < outHeight * blockHeight; y++) {
+        if (std::fread(row.data(), 1, row.size(), file.get()) != row.size()) {
+            break;
+        }
+        for (int x = 0; x < outWidth * blockWidth; x++) {
+            for (int c = 0; c < channels; c++) {
+                const unsigned char *sample =
+                    &row[(static_cast<size_t>(x) * channels + c) * bytes];
+                sums[x / blockWidth * channels + c] +=
+                    bytes == 2 ? sample[0] << 8 | sample[1] : sample[0];
+            }
+        }
+        if ((y + 1) % blockHeight) continue;
+        for (int x = 0; x < outWidth; x++) {
+            for (int c = 0; c < 3; c++) {
+                image(x, y / blockHeight, 0, c) =
+                    sums[x * channels + c % channels] * scale;
+            }
+        }
+        std::fill(sums.begin(), sums.end(), 0);
+    }
+    return image;
+}
+
+/**
+ * @brief Decodes a JPEG file at a fraction of its size through ImageMagick,
+ * which uses the DCT scaling of libjpeg, so the full image is never decoded.
+ *
+ * @return The samples scaled to 16 bits, empty if the file is not a JPEG file
+ * or decoding it did not work
+ */
+cimg_library::CImg<float> loadJpegReduced(const std::string &filename,
+                                          int width, int height) {
+    cimg_library::CImg<float> image;
+    std::ifstream in(filename, std::ios::binary);
+    if (in.get() != 0xff || in.get() != 0xd8) return image;
+#ifdef _POSIX_VERSION
+    const std::string geometry = std::format("{}x{}", width, height);
+    std::FILE *pipe = popen(("convert -define jpeg:size=" + geometry + " " +
+                             shellQuote(filename) + " -resize " + geometry +
+                             "! ppm:- 2>/dev/null")
+                                .c_str(),
+                            "r");
+    if (pipe) {
+        try {
+            cimg_library::CImg<unsigned char> decoded;
+            decoded.load_pnm(pipe);
+            image = decoded;
+            image *= 257;
+        } catch (cimg_library::CImgException &e) {
+            image.assign();
+        }
+        pclose(pipe);
+    }
+#endif
+    if (image.spectrum() == 1) image.resize(-100, -100, -100, 3, 1);
+    return image;
+}
+
+// Whether an image of the given size and number of frames fits the budget,
+// when decoded at 1 / divisor of its size.
+bool fitsBudget(const Budget &budget, int width, int height, uint64_t frames,
+                SampleFormat format, int divisor = 1) {
+    const uint64_t pixels =
+        static_cast<uint64_t>(width / divisor) * (height / divisor) * frames;
+    // Reduced images are decoded to floats
+    const uint64_t memory =
+        estimateMemory(pixels, divisor > 1 ? SAMPLES_16BIT : format);
+    return (!budget.maxPixels || pixels <= budget.maxPixels) &&
+           (!budget.maxMemory || memory <= budget.maxMemory);
+}
+
+/**
+ * @brief Whether the image fits the budget at its full size, judging from its
+ * header. Images without a known size only fit if there is no budget.
+ */
+bool withinBudget(const std::string &filename, const Budget &budget) {
+    if (!budget.maxPixels && !budget.maxMemory) return true;
+    int width, height;
+    if (!readAnyImageSize(filename, width, height)) return false;
+    const uint64_t frames = std::max<size_t>(1, readGifDelays(filename).size());
+    return fitsBudget(budget, width, height, frames,
+                      readSampleFormat(filename));
+}
+
+/**
+ * @brief Checks the image against the budget before decoding it. Images over
+ * budget are decoded at the largest fraction of their size that fits, where
+ * the format allows that.
+ *
+ * @param filename The file to check
+ * @param format Its sample format, see readSampleFormat()
+ * @param budget The limits
+ * @param[out] reduced The image decoded at reduced size, if it had to be
+ * @throws std::length_error If the image is over budget and cannot be decoded
+ * at a reduced size, or if its size cannot be determined
+ */
+void checkBudget(const std::string &filename, SampleFormat format,
+                 const Budget &budget, cimg_library::CImg<float> &reduced) {
+    if (!budget.maxPixels && !budget.maxMemory) return;
+    int width, height;
+    if (!readAnyImageSize(filename, width, height)) {
+        throw std::length_error("has no size in its header");
+    }
+    const uint64_t frames = std::max<size_t>(1, readGifDelays(filename).size());
+    auto fits = [&](int divisor) {
+        return fitsBudget(budget, width, height, frames, format, divisor);
+    };
+    if (fits(1)) return;
+
+    int divisor = 2;
+    while (divisor < std::max(width, height) && !fits(divisor)) divisor++;
+    if (fits(divisor) && frames == 1) {
+        reduced = loadPnmReduced(filename, divisor);
+        if (reduced.is_empty()) {
+            reduced = loadJpegReduced(filename, std::max(1, width / divisor),
+                                      std::max(1, height / divisor));
+        }
+        if (!reduced.is_empty()) return;
+    }
+    throw std::length_error(std::format(
+        "is {}x{} pixels, over budget, and cannot be decoded at a reduced size",
+        width, height));
+}
+
+/**
+ * @brief Loads an image as 8-bit sRGB and fits it into the given size.
+ *
+ * Images with more than 8 bits per sample, or any image with an exposure
+ * other than 0, are tone mapped in the linear light downscale pass, so there
+ * is no 8-bit image at their full size. With FLAG_SNAP, images are only
+ * resized by whole ratios, which skips the resampler.
+ *
+ * Images over the budget are decoded at reduced size, see checkBudget().
+ *
+ * @param filename The file to load
+ * @param maxSize The size to fit the image into
+ * @param enlarge Whether smaller images are enlarged to fit as well
+ * @param depth The new depth, or -100 to keep all frames
+ * @param flags
+ * @param exposure Exposure adjustment in stops
+ * @param budget Limits for decoding the image
+ * @return The image
+ * @throws std::length_error If the image is over budget
+ */
+cimg_library::CImg<unsigned char> loadImage(const std::string &filename,
+                                            size maxSize, bool enlarge,
+                                            int depth, const int &flags,
+                                            float exposure,
+                                            const Budget &budget) {
+    auto fit = [&](size imageSize) {
+        if (!enlarge && imageSize.width <= maxSize.width &&
+            imageSize.height <= maxSize.height) {
+            return imageSize;
+        }
+        return flags & FLAG_SNAP ? imageSize.snapped_within(maxSize)
+                                 : imageSize.fitted_within(maxSize);
+    };
+
+    int maxValue;
+    SampleFormat format = readSampleFormat(filename, &maxValue);
+    cimg_library::CImg<float> image;
+    checkBudget(filename, format, budget, image);
+    if (image.is_empty() && format == SAMPLES_8BIT && exposure == 0) {
+        cimg_library::CImg<unsigned char> rgb =
+            load_rgb_CImg(filename.c_str());
+        size newSize = fit(size(rgb.width(), rgb.height()));
+        if (static_cast<int>(newSize.width) != rgb.width() ||
+            static_cast<int>(newSize.height) != rgb.height()) {
+            resizeImage(rgb, newSize.width, newSize.height, depth, flags);
+        }
+        return rgb;
+    }
+
+    if (!image.is_empty()) {
+        format = SAMPLES_16BIT;  // Reduced images are scaled to 16 bits
+    } else if (format == SAMPLES_8BIT) {
+        image = load_rgb_CImg(filename.c_str());
+        image *= 257;  // Same range as 16 bits
+        format = SAMPLES_16BIT;
+    } else {
+        image = loadHighDepth(filename, format, maxValue);
+    }
+    size newSize = fit(size(image.width(), image.height()));
+    return resizeLinear(image, std::max(1u, newSize.width),
+                        std::max(1u, newSize.height), depth, flags,
+                        ToneMap(image, format, std::exp2(exposure)));
+}
+
+/**
+ * @brief Shows the image at the full width, streaming it from top to bottom
+ * into the scrollback instead of fitting it into the terminal.
+ *
+ * Binary PGM and PPM files are read directly, other files are converted to
+ * PPM on the fly by ImageMagick. Rows are shrunk and resampled as they come
+ * in, like resizeSamples() does, and each row of cells is written as soon as
+ * its pixels are done. Memory thus stays at a few rows of the image, and the
+ * top shows up right away, however tall the image is.
+ *
+ * The budget counts all pixels of the image, but only the memory for a row,
+ * as no more is held at a time. Images over budget, or without a size in
+ * their header when there is a budget, are left to loadImage().
+ *
+ * @param filename The image
+ * @param maxWidth The width to fit in pixels
+ * @param flags
+ * @param budget Limits for decoding the image
+ * @return Whether the image could be streamed; high bit depth images, images
+ * over budget and files that ImageMagick cannot read are not
+ */
+bool scrollImage(const std::string &filename, int maxWidth, const int &flags,
+                 const Budget &budget) {
+    const SampleFormat format = readSampleFormat(filename);
+    if (format != SAMPLES_8BIT && format != SAMPLES_16BIT) return false;
+    auto fits = [&](int width, int height) {
+        return (!budget.maxPixels ||
+                static_cast<uint64_t>(width) * height <= budget.maxPixels) &&
+               (!budget.maxMemory ||
+                estimateMemory(width, format) <= budget.maxMemory);
+    };
+    std::unique_ptr<std::FILE, int (*)(std::FILE *)> file(
+        std::fopen(filename.c_str(), "rb"), std::fclose);
+    int width, height, maxValue, channels;
+    if (!file ||
+        !readPnmHeader(file.get(), width, height, maxValue, channels)) {
+#ifdef _POSIX_VERSION
+        if (budget.maxPixels || budget.maxMemory) {
+            if (!readAnyImageSize(filename, width, height) ||
+                !fits(width, height)) {
+                return false;
+            }
+        }
+        // Only the first frame of animations
+        file = {popen(("convert " + shellQuote(filename + "[0]") +
+                       " ppm:- 2>/dev/null")
+                          .c_str(),
+                      "r"),
+                pclose};
+        if (!file ||
+            !readPnmHeader(file.get(), width, height, maxValue, channels)) {
+            return false;
+        }
+#else
+        return false;
+#endif
+    }
+    if (!fits(width, height)) return false;
+
+    const int bytes = maxValue > 255 ? 2 : 1;
+    const int outWidth = std::min(maxWidth, width);
+    const int outHeight =
+        std::max<int64_t>(1, static_cast<int64_t>(height) * outWidth / width);
+    const int factor = std::max(1, width / outWidth);
+    const int blockHeight = std::min(factor, height);
+    const int inWidth = width / factor;
+    const int inHeight = height / blockHeight;
+    const FilterBank columns = makeFilterBank(inWidth, outWidth, flags);
+    const FilterBank rows = makeFilterBank(inHeight, outHeight, flags);
+    constexpr int32_t half = 1 << (FilterBank::PRECISION - 1);
+
+    // From samples to 16 bits, in linear light with FLAG_LINEAR, and back
+    std::vector<uint16_t> toLinear(maxValue + 1);
+    for (int i = 0; i <= maxValue; i++) {
+        double v = static_cast<double>(i) / maxValue;
+        if (flags & FLAG_LINEAR) {
+            v = v <= 0.04045 ? v / 12.92 : std::pow((v + 0.055) / 1.055, 2.4);
+        }
+        toLinear[i] = std::lround(v * 65535);
+    }
+    const std::array<uint8_t, 65536> &toSrgb = linearToSrgb();
+    auto fromLinear = [&](int32_t value) -> unsigned char {
+        value = std::clamp(value, 0, 65535);
+        return flags & FLAG_LINEAR ? toSrgb[value] : (value + 128) / 257;
+    };
+
+    std::vector<unsigned char> row(static_cast<size_t>(width) * channels *
+                                   bytes);
+    // Sums of the blocks being shrunk, one plane per channel. A block has up
+    // to factor squared 16-bit samples, more than 32 bits can hold.
+    std::vector<uint64_t> sums(static_cast<size_t>(inWidth) * channels);
+    std::vector<int32_t> shrunk(sums.size());
+    const uint64_t count = static_cast<uint64_t>(factor) * blockHeight;
+    // The shrunk rows that the next output row needs, resampled horizontally
+    std::deque<std::vector<uint16_t>> window;
+    int windowStart = 0;  // Index of the first row in the window
+    cimg_library::CImg<unsigned char> band(outWidth, 8, 1, 3);
+    int y = 0;  // The next output row
+    for (int sy = 0; sy < inHeight * blockHeight && y < outHeight; sy++) {
+        if (std::fread(row.data(), 1, row.size(), file.get()) != row.size()) {
+            break;
+        }
+        for (int x = 0; x < inWidth * factor; x++) {
+            for (int c = 0; c < channels; c++) {
+                const unsigned char *sample =
+                    &row[(static_cast<size_t>(x) * channels + c) * bytes];
+                const int value =
+                    bytes == 2 ? sample[0] << 8 | sample[1] : sample[0];
+                sums[c * inWidth + x / factor] +=
+                    toLinear[std::min(value, maxValue)];
+            }
+        }
+        if ((sy + 1) % blockHeight) continue;
+        for (size_t i = 0; i < sums.size(); i++) {
+            shrunk[i] = (sums[i] + count / 2) / count;
+            sums[i] = 0;
+        }
+
+        std::vector<uint16_t> wide(static_cast<size_t>(outWidth) * channels);
+        for (int c = 0; c < channels; c++) {
+            const int32_t *in = &shrunk[c * inWidth];
+            for (int x = 0; x < outWidth; x++) {
+                const int32_t *weight =
+                    &columns.weights[static_cast<size_t>(x) * columns.taps];
+                int32_t sum = half;
+                for (int k = 0; k < columns.taps; k++) {
+                    sum += weight[k] * in[columns.start[x] + k];
+                }
+                wide[c * outWidth + x] =
+                    std::clamp(sum >> FilterBank::PRECISION, 0, 65535);
+            }
+        }
+        window.push_back(std::move(wide));
+
+        // Output rows whose input rows have all been read
+        const int available = windowStart + window.size();
+        while (y < outHeight && rows.start[y] + rows.taps <= available) {
+            for (; windowStart < rows.start[y]; windowStart++) {
+                window.pop_front();
+            }
+            const int32_t *weight =
+                &rows.weights[static_cast<size_t>(y) * rows.taps];
+            for (int c = 0; c < 3; c++) {
+                for (int x = 0; x < outWidth; x++) {
+                    int32_t sum = half;
+                    for (int k = 0; k < rows.taps; k++) {
+                        sum += weight[k] *
+                               window[k][c % channels * outWidth + x];
+                    }
+                    band(x, y % 8, 0, c) =
+                        fromLinear(sum >> FilterBank::PRECISION);
+                }
+            }
+            if (++y % 8) continue;
+            std::pmr::string text;
+            const std::pmr::vector<CharData> cells = findRow(band, 0, flags);
+            emitCells(text, cells, 0, cells.size(), y / 8 - 1, flags, nullptr);
+            text += "\x1b[0m\n";
+            output().publish(output().reserve(), std::move(text));
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Decompresses raw deflate data (RFC 1951), as stored in zip files.
+ *
+ * @param data The compressed data
+ * @param size Its size in bytes
+ * @param expected The size of the decompressed data. Decompression stops
+ * there, so a corrupt or malicious stream cannot take more memory.
+ * @return The decompressed data
+ * @throws std::runtime_error If the data is invalid, or does not decompress to
+ * the expected size
+ */
+std::vector<unsigned char> inflate(const unsigned char *data, size_t size,
+                                   size_t expected) {
+    static constexpr uint16_t LENGTH_BASE[29] = {
+        3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+        31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static constexpr uint8_t LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                                 1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                                 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static constexpr uint16_t DISTANCE_BASE[30] = {
+        1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+        33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+        1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577};
+    static constexpr uint8_t DISTANCE_EXTRA[30] = {
+        0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+        6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+    static constexpr uint8_t CODE_LENGTH_ORDER[19] = {
+        16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+    // Deflate expands data by 1032 times at most, whatever the header says
+    if (expected / 1032 > size) {
+        throw std::runtime_error("impossible decompressed size");
+    }
+    std::vector<unsigned char> out;
+    out.reserve(expected);
+    auto ensureRoom = [&](size_t length) {
+        if (length > expected - out.size()) {
+            throw std::runtime_error("more data than declared");
+        }
+    };
+    size_t pos = 0;
+    uint32_t bitBuffer = 0;
+    int bitCount = 0;
+    auto bits = [&](int count) {
+        while (bitCount < count) {
+            if (pos >= size) throw std::runtime_error("truncated deflate data");
+            bitBuffer |= static_cast<uint32_t>(data[pos++]) << bitCount;
+            bitCount += 8;
+        }
+        uint32_t value = bitBuffer & ((1u << count) - 1);
+        bitBuffer >>= count;
+        bitCount -= count;
+        return static_cast<int>(value);
+    };
+
+    // Canonical Huffman codes, as the number of codes of each length and
+    // the symbols ordered by code
+    struct Huffman {
+        uint16_t counts[16];
+        uint16_t symbols[288];
+    };
+    auto build = [](Huffman &code, const uint8_t *lengths, int count) {
+        std::fill(std::begin(code.counts), std::end(code.counts), 0);
+        for (int i = 0; i < count; i++) code.counts[lengths[i]]++;
+        code.counts[0] = 0;
+        uint16_t offsets[16] = {0};
+        for (int length = 1; length < 15; length++) {
+            offsets[length + 1] = offsets[length] + code.counts[length];
+        }
+        for (int i = 0; i < count; i++) {
+            if (lengths[i]) code.symbols[offsets[lengths[i]]++] = i;
+        }
+    };
+    auto decode = [&](const Huffman &code) {
+        int value = 0;  // Code read so far
+        int first = 0;  // First code of the current length
+        int index = 0;  // Index of that code in the symbols
+        for (int length = 1; length < 16; length++) {
+            value |= bits(1);
+            const int count = code.counts[length];
+            if (value - first < count) {
+                return code.symbols[index + value - first];
+            }
+            index += count;
+            first = (first + count) << 1;
+            value <<= 1;
+        }
+        throw std::runtime_error("invalid deflate code");
+    };
+
+    Huffman literals, distances;
+    for (bool last = false; !last;) {
+        last = bits(1);
+        const int type = bits(2);
+        if (type == 0) {
+            // Stored block, starting at the next whole byte
+            bitBuffer = 0;
+            bitCount = 0;
+            if (pos + 4 > size) throw std::runtime_error("truncated block");
+            const size_t length = data[pos] | data[pos + 1] << 8;
+            pos += 4;
+            if (pos + length > size) {
+                throw std::runtime_error("truncated block");
+            }
+            ensureRoom(length);
+            out.insert(out.end(), data + pos, data + pos + length);
+            pos += length;
+            continue;
+        }
+        uint8_t lengths[320];
+        if (type == 1) {
+            // Fixed codes
+            std::fill(lengths, lengths + 144, 8);
+            std::fill(lengths + 144, lengths + 256, 9);
+            std::fill(lengths + 256, lengths + 280, 7);
+            std::fill(lengths + 280, lengths + 288, 8);
+            std::fill(lengths + 288, lengths + 318, 5);
+            build(literals, lengths, 288);
+            build(distances, lengths + 288, 30);
+        } else if (type == 2) {
+            // Dynamic codes, their lengths compressed with another code
+            const int literalCount = bits(5) + 257;
+            const int distanceCount = bits(5) + 1;
+            const int lengthCount = bits(4) + 4;
+            uint8_t codeLengths[19] = {0};
+            for (int i = 0; i < lengthCount; i++) {
+                codeLengths[CODE_LENGTH_ORDER[i]] = bits(3);
+            }
+            Huffman lengthCode;
+            build(lengthCode, codeLengths, 19);
+            const int total = literalCount + distanceCount;
+            for (int i = 0; i < total;) {
+                const int symbol = decode(lengthCode);
+                if (symbol < 16) {
+                    lengths[i++] = symbol;
+                    continue;
+                }
+                int repeat;
+                uint8_t value = 0;
+                if (symbol == 16) {
+                    if (i == 0) throw std::runtime_error("invalid repeat");
+                    value = lengths[i - 1];
+                    repeat = 3 + bits(2);
+                } else if (symbol == 17) {
+                    repeat = 3 + bits(3);
+                } else {
+                    repeat = 11 + bits(7);
+                }
+                if (i + repeat > total) {
+                    throw std::runtime_error("invalid repeat");
+                }
+                std::fill(lengths + i, lengths + i + repeat, value);
+                i += repeat;
+            }
+            build(literals, lengths, literalCount);
+            build(distances, lengths + literalCount, distanceCount);
+        } else {
+            throw std::runtime_error("invalid block type");
+        }
+
+        for (int symbol; (symbol = decode(literals)) != 256;) {
+            if (symbol < 256) {
+                ensureRoom(1);
+                out.push_back(symbol);
+                continue;
+            }
+            symbol -= 257;
+            if (symbol >= 29) throw std::runtime_error("invalid length");
+            const int length = LENGTH_BASE[symbol] + bits(LENGTH_EXTRA[symbol]);
+            const int code = decode(distances);
+            if (code >= 30) throw std::runtime_error("invalid distance");
+            const size_t distance =
+                DISTANCE_BASE[code] + bits(DISTANCE_EXTRA[code]);
+            if (distance > out.size()) {
+                throw std::runtime_error("distance too far back");
+            }
+            ensureRoom(length);
+            // Byte by byte, the copy may overlap what it appends
+            for (int i = 0; i < length; i++) {
+                out.push_back(out[out.size() - distance]);
+            }
+        }
+    }
+    if (out.size() != expected) {
+        throw std::runtime_error("less data than declared");
+    }
+    return out;
+}
+
+/**
+ * @brief A tar or zip archive, mapped into memory, and the regular files in
+ * it.
+ *
+ * Tar headers are walked in order. Zip files are read through the central
+ * directory at their end, members are either stored or deflated.
+ */
+class Archive {
+   public:
+    struct Member {
+        std::string name;            // Path inside the archive
+        const unsigned char *data;   // Stored data, in the mapping
+        size_t storedSize;           // Size of the stored data
+        size_t size;                 // Size when extracted
+        bool deflated;               // Whether the data needs inflate()
+    };
+
+    ~Archive() {
+#ifdef _POSIX_VERSION
+        if (mapping) munmap(mapping, mappingSize);
+#endif
+    }
+
+    /**
+     * @brief Opens the file as an archive.
+     *
+     * @return The archive, or null if the file is no tar or zip archive
+     */
+    static std::unique_ptr<Archive> open(const std::string &filename) {
+        std::unique_ptr<Archive> archive(new Archive());
+#ifdef _POSIX_VERSION
+        const int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return nullptr;
+        struct stat status;
+        if (fstat(fd, &status) == 0 && S_ISREG(status.st_mode) &&
+            status.st_size >= 22) {  // The smallest zip file
+            archive->mappingSize = status.st_size;
+            void *mapping = mmap(nullptr, archive->mappingSize, PROT_READ,
+                                 MAP_PRIVATE, fd, 0);
+            archive->mapping = mapping == MAP_FAILED ? nullptr : mapping;
+        }
+        close(fd);
+#endif
+        if (!archive->mapping ||
+            !(archive->readTar() || archive->readZip())) {
+            return nullptr;
+        }
+        return archive;
+    }
+
+    const std::vector<Member> &members() const { return entries; }
+
+    /**
+     * @brief Extracts a member into memory.
+     * @throws std::runtime_error If its data is corrupt
+     */
+    std::vector<unsigned char> extract(const Member &member) const {
+        if (member.deflated) {
+            return inflate(member.data, member.storedSize, member.size);
+        }
+        return std::vector<unsigned char>(member.data,
+                                          member.data + member.storedSize);
+    }
+
+   private:
+    void *mapping = nullptr;
+    size_t mappingSize = 0;
+    std::vector<Member> entries;
+
+    Archive() = default;
+
+    const unsigned char *bytes() const {
+        return static_cast<const unsigned char *>(mapping);
+    }
+
+    bool readTar() {
+        const unsigned char *data = bytes();
+        if (mappingSize < 512 || std::memcmp(data + 257, "ustar", 5) != 0) {
+            return false;
+        }
+        std::string longName;  // From a preceding GNU long name entry
+        for (size_t offset = 0; offset + 512 <= mappingSize;) {
+            const unsigned char *header = data + offset;
+            if (header[0] == 0) break;  // End of archive
+            size_t size = 0;
+            for (int i = 124; i < 136 && header[i] >= '0' && header[i] <= '7';
+                 i++) {
+                size = size * 8 + header[i] - '0';
+            }
+            const size_t start = offset + 512;
+            if (size > mappingSize - start) break;  // Truncated
+            const char type = header[156];
+            auto field = [&](int at, int length) {
+                const char *text = reinterpret_cast<const char *>(header + at);
+                return std::string(text, strnlen(text, length));
+            };
+            if (type == 'L') {
+                longName = std::string(reinterpret_cast<const char *>(
+                                           data + start),
+                                       strnlen(reinterpret_cast<const char *>(
+                                                   data + start),
+                                               size));
+            } else {
+                if (type == '0' || type == '\0') {
+                    std::string name = longName;
+                    if (name.empty()) {
+                        const std::string prefix = field(345, 155);
+                        name = (prefix.empty() ? "" : prefix + "/") +
+                               field(0, 100);
+                    }
+                    entries.push_back(
+                        {name, data + start, size, size, false});
+                }
+                longName.clear();
+            }
+            offset = start + (size + 511) / 512 * 512;
+        }
+        return true;
+    }
+
+    bool readZip() {
+        const unsigned char *data = bytes();
+        auto le16 = [&](size_t at) { return data[at] | data[at + 1] << 8; };
+        auto le32 = [&](size_t at) {
+            return static_cast<uint32_t>(le16(at) | le16(at + 2) << 16);
+        };
+        if (le32(0) != 0x04034b50) return false;
+        // The end of central directory record, before an optional comment
+        size_t end = mappingSize - 22;
+        const size_t stop = mappingSize > 22 + 65535 ? end - 65535 : 0;
+        while (le32(end) != 0x06054b50) {
+            if (end == stop) return false;
+            end--;
+        }
+        const int count = le16(end + 10);
+        size_t entry = le32(end + 16);
+        for (int i = 0; i < count; i++) {
+            if (entry + 46 > mappingSize || le32(entry) != 0x02014b50) break;
+            const int flags = le16(entry + 8);
+            const int method = le16(entry + 10);
+            const size_t storedSize = le32(entry + 20);
+            const size_t size = le32(entry + 24);
+            const int nameLength = le16(entry + 28);
+            const size_t local = le32(entry + 42);
+            std::string name(reinterpret_cast<const char *>(data + entry + 46),
+                             nameLength);
+            entry += 46 + nameLength + le16(entry + 30) + le16(entry + 32);
+            // Skip directories, encrypted and otherwise compressed members
+            if (name.empty() || name.back() == '/' || (flags & 1) ||
+                (method != 0 && method != 8) || local + 30 > mappingSize ||
+                le32(local) != 0x04034b50) {
+                continue;
+            }
+            const size_t start =
+                local + 30 + le16(local + 26) + le16(local + 28);
+            if (start > mappingSize || storedSize > mappingSize - start) {
+                continue;
+            }
+            entries.push_back({name, data + start, storedSize, size,
+                               method == 8});
+        }
+        return true;
+    }
+};
+
+/**
+ * @brief An image to show: a file, or a member of an archive.
+ */
+struct Input {
+    std::string name;  // The file name, or the archive's and the member's
+    const Archive *archive = nullptr;
+    size_t member = 0;
+};
+
+/**
+ * @brief Makes an input available under a file name for as long as the
+ * object lives.
+ *
+ * Archive members are extracted into an anonymous file in memory, which is
+ * reachable through /dev/fd, also for the ImageMagick processes CImg starts.
+ * Nothing is written to disk.
+ */
+class InputFile {
+   public:
+    /**
+     * @param input The input
+     * @param budget Limits for decoding, which the extracted size of archive
+     * members must keep to as well
+     * @throws std::length_error If the member is larger than the budget
+     * @throws std::runtime_error If the member cannot be extracted
+     */
+    InputFile(const Input &input, const Budget &budget) : path(input.name) {
+        if (!input.archive) return;
+        const Archive::Member &member =
+            input.archive->members()[input.member];
+        if (budget.maxMemory && member.size > budget.maxMemory) {
+            throw std::length_error(std::format(
+                "would take {} bytes to extract, over budget", member.size));
+        }
+        std::vector<unsigned char> data = input.archive->extract(member);
+#ifdef _POSIX_VERSION
+#ifdef __linux__
+        fd = memfd_create("tiv", 0);
+#else
+        file = std::tmpfile();
+        fd = file ? fileno(file) : -1;
+#endif
+        size_t done = 0;
+        while (fd >= 0 && done < data.size()) {
+            ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            done += n;
+        }
+        if (fd < 0 || done < data.size()) {
+            throw std::runtime_error("Cannot extract " + input.name);
+        }
+        lseek(fd, 0, SEEK_SET);
+        path = "/dev/fd/" + std::to_string(fd);
+#endif
+    }
+    ~InputFile() {
+#ifdef _POSIX_VERSION
+        if (file) {
+            std::fclose(file);
+        } else if (fd >= 0) {
+            close(fd);
+        }
+#endif
+    }
+    InputFile(const InputFile &) = delete;
+    InputFile &operator=(const InputFile &) = delete;
+
+    std::string path;  // Where to read the input from
+
+   private:
+    int fd = -1;
+    std::FILE *file = nullptr;
+};
+
+/**
+ * @brief What the terminal we are writing to can do.
+ */
+struct TermCaps {
+    bool truecolor = false;  // 24-bit colors
+    bool rep = false;        // Repeat preceding character (CSI b)
+    bool sync = false;       // Synchronized updates (DEC private mode 2026)
+    bool sixel = false;      // Sixel graphics
+    bool kitty = false;      // Kitty graphics protocol
+    int cellWidth = 0;       // Character cell size in pixels, 0 if unknown
+    int cellHeight = 0;
+};
+
+// How long to wait in milliseconds for answers that missed the probe timeout,
+// before giving up on them.
+constexpr int PROBE_DRAIN_TIMEOUT = 1000;
+
+// Terminals that support 24-bit colors by the name they report in XTVERSION,
+// for those that don't answer XTGETTCAP.
+constexpr const char *TRUECOLOR_TERMINALS[] = {
+    "kitty", "WezTerm", "foot", "iTerm2", "XTerm", "tmux", "mintty", "ghostty"};
+
+// The key under which the capabilities of the current terminal are cached.
+std::string termCapsKey() {
+    std::string tty;
+#ifdef _POSIX_VERSION
+    const char *name = ttyname(STDOUT_FILENO);
+    if (name) tty = name;
+#endif
+    return getEnv("TERM") + '\t' + getEnv("TERM_PROGRAM") + ' ' +
+           getEnv("TERM_PROGRAM_VERSION") + '\t' + tty;
+}
+
+std::filesystem::path termCapsCachePath() {
+    std::string cache = getEnv("XDG_CACHE_HOME");
+    if (!cache.empty()) {
+        return std::filesystem::path(cache) / "tiv" / "terminals";
+    }
+    std::string home = getEnv("HOME");
+    if (!home.empty()) {
+        return std::filesystem::path(home) / ".cache" / "tiv" / "terminals";
+    }
+    return {};
+}
+
+/**
+ * @brief Looks up the capabilities of the current terminal in the cache.
+ *
+ * The cache has one line per terminal: the key from termCapsKey(), a tab and
+ * the capabilities as space separated numbers.
+ *
+ * @param caps Receives the capabilities
+ * @return Whether the terminal was found in the cache
+ */
+bool loadTermCaps(TermCaps &caps) {
+    std::filesystem::path path = termCapsCachePath();
+    if (path.empty()) return false;
+    std::ifstream in(path);
+    std::string key = termCapsKey() + '\t';
+    for (std::string line; std::getline(in, line);) {
+        if (line.compare(0, key.size(), key) != 0) continue;
+        std::istringstream values(line.substr(key.size()));
+        return static_cast<bool>(values >> caps.truecolor >> caps.rep >>
+                                 caps.sync >> caps.sixel >> caps.kitty >>
+                                 caps.cellWidth >> caps.cellHeight);
+    }
+    return false;
+}
+
+// Stores the capabilities of the current terminal in the cache, replacing an
+// older entry. Failing to do so is harmless, we'll just probe again.
+void saveTermCaps(const TermCaps &caps) {
+    std::filesystem::path path = termCapsCachePath();
+    if (path.empty()) return;
+    std::error_code error;
+    std::filesystem::create_directories(path.parent_path(), error);
+
+    std::string key = termCapsKey() + '\t';
+    std::string lines;
+    std::ifstream in(path);
+    for (std::string line; std::getline(in, line);) {
+        if (line.compare(0, key.size(), key) != 0) lines += line + '\n';
+    }
+    in.close();
+    lines += std::format("{}{} {} {} {} {} {} {}\n", key, +caps.truecolor,
+                         +caps.rep, +caps.sync, +caps.sixel, +caps.kitty,
+                         caps.cellWidth, caps.cellHeight);
+
+    // Write a copy and move it over, so concurrent runs never see half a file
+    std::filesystem::path temp = path;
+    temp += std::format(
+        ".{}", std::chrono::steady_clock::now().time_since_epoch().count());
+    std::ofstream out(temp);
+    out << lines;
+    out.close();
+    if (out) {
+        std::filesystem::rename(temp, path, error);
+    } else {
+        std::filesystem::remove(temp, error);
+    }
+}
+
+/**
+ * @brief Finds a reply of the form prefix, parameters (digits and
+ * semicolons), suffix.
+ *
+ * @param reply Everything the terminal answered
+ * @param prefix The start of the reply
+ * @param suffix The end of the reply
+ * @param params Receives the parameters
+ * @return Whether such a reply was found
+ */
+bool findReply(const std::string &reply, const std::string &prefix,
+               const std::string &suffix, std::string &params) {
+    for (size_t pos = reply.find(prefix); pos != std::string::npos;
+         pos = reply.find(prefix, pos + 1)) {
+        size_t end = pos + prefix.size();
+        while (end < reply.size() &&
+               (std::isdigit(static_cast<unsigned char>(reply[end])) ||
+                reply[end] == ';')) {
+            end++;
+        }
+        if (reply.compare(end, suffix.size(), suffix) == 0) {
+            size_t start = pos + prefix.size();
+            params = reply.substr(start, end - start);
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Asks the terminal what it can do.
+ *
+ * Sends XTVERSION, XTGETTCAP, DECRQM, kitty graphics and cell size queries,
+ * followed by a primary device attributes (DA1) request. Every terminal
+ * answers DA1, and answers arrive in the order of the queries, so the DA1
+ * answer marks the end of the answers; the other queries may go unanswered.
+ *
+ * If the answers are late, e.g. over a slow SSH connection, the terminal is
+ * taken to lack what it hasn't answered. We still wait a while longer for the
+ * rest to arrive and discard it, so it doesn't end up in the shell as input.
+ *
+ * @param timeout Time to wait for the answers in milliseconds
+ * @param caps Receives the capabilities
+ * @return Whether the terminal could be asked, even if it didn't answer in
+ * time
+ */
+bool probeTermCaps(int timeout, TermCaps &caps) {
+#ifdef _POSIX_VERSION
+    int fd = open("/dev/tty", O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0) return false;
+    // Don't probe from the background, we'd just get stopped
+    termios saved;
+    if (tcgetpgrp(fd) != getpgrp() || tcgetattr(fd, &saved) != 0) {
+        close(fd);
+        return false;
+    }
+    termios raw = saved;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(fd, TCSANOW, &raw);
+
+    const std::string query =
+        "\x1b[>0q"                                     // XTVERSION
+        "\x1bP+q524742\x1b\\"                          // XTGETTCAP RGB
+        "\x1bP+q5463\x1b\\"                            // XTGETTCAP Tc
+        "\x1bP+q726570\x1b\\"                          // XTGETTCAP rep
+        "\x1b[?2026$p"                                 // DECRQM 2026
+        "\x1b_Gi=31,s=1,v=1,a=q,t=d,f=24;AAAA\x1b\\"  // kitty graphics
+        "\x1b[16t"                                     // Cell size
+        "\x1b[c";                                      // DA1
+    std::string reply;
+    std::string params;
+    bool answered = false;
+    const bool sent = write(fd, query.data(), query.size()) ==
+                      static_cast<ssize_t>(query.size());
+    // Reads answers until DA1 is answered or the deadline passes.
+    auto readReplies = [&](std::string &into, int wait) {
+        auto deadline = std::chrono::steady_clock::now() +
+                        std::chrono::milliseconds(wait);
+        while (!findReply(into, "\x1b[?", "c", params)) {
+            int left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                           deadline - std::chrono::steady_clock::now())
+                           .count();
+            pollfd pfd = {fd, POLLIN, 0};
+            if (left <= 0 || poll(&pfd, 1, left) <= 0) return false;
+            char buffer[256];
+            ssize_t n = read(fd, buffer, sizeof(buffer));
+            if (n <= 0) return false;
+            into.append(buffer, n);
+        }
+        return true;
+    };
+    if (sent) answered = readReplies(reply, timeout);
+    if (sent && !answered) {
+        std::string late = reply;
+        readReplies(late, PROBE_DRAIN_TIMEOUT);
+    }
+    // Drop anything unparsed so it doesn't end up in the shell
+    tcsetattr(fd, TCSAFLUSH, &saved);
+
+    caps = TermCaps();
+    if (answered) {
+        // DA1 lists 4 among its attributes for sixel support
+        caps.sixel = (';' + params + ';').find(";4;") != std::string::npos;
+    }
+    caps.truecolor = reply.find("\x1bP1+r524742") != std::string::npos ||
+                     reply.find("\x1bP1+r5463") != std::string::npos;
+    size_t version = reply.find("\x1bP>|");
+    for (const char *name : TRUECOLOR_TERMINALS) {
+        if (version != std::string::npos &&
+            reply.compare(version + 4, std::strlen(name), name) == 0) {
+            caps.truecolor = true;
+        }
+    }
+    caps.rep = reply.find("\x1bP1+r726570") != std::string::npos;
+    // DECRPM: 1 = set, 2 = reset, 3 = permanently set
+    caps.sync = findReply(reply, "\x1b[?2026;", "$y", params) &&
+                (params == "1" || params == "2" || params == "3");
+    caps.kitty = reply.find("\x1b_Gi=31;OK") != std::string::npos;
+
+    winsize w;
+    if (ioctl(fd, TIOCGWINSZ, &w) == 0 && w.ws_col && w.ws_row &&
+        w.ws_xpixel && w.ws_ypixel) {
+        caps.cellWidth = w.ws_xpixel / w.ws_col;
+        caps.cellHeight = w.ws_ypixel / w.ws_row;
+    } else if (findReply(reply, "\x1b[6;", "t", params)) {
+        size_t separator = params.find(';');
+        if (separator != std::string::npos) {
+            caps.cellHeight = std::atoi(params.c_str());
+            caps.cellWidth = std::atoi(params.c_str() + separator + 1);
+        }
+    }
+    close(fd);
+    return sent;
+#else
+    return false;
+#endif
+}
+
+// Implements --help
+void printUsage() {
+    std::cerr << R"(
+Terminal Image Viewer v1.3
+usage: tiv [options] <image> [<image>...]
+Images may also be directories, or tar and zip archives of images.
+-0        : No block character adjustment, always use top half block char.
+-2, --256 : Use 256-bit colors. Needed to display properly on macOS Terminal.
+--16, --8 : Use only the basic 16 or 8 ANSI colors.
+--no-linear: Average colors of sRGB values rather than in linear light.
+--oklab   : Compare colors perceptually, in the Oklab color space.
+--palette : Use 256 colors redefined for a single image. They are restored on
+            exit, which recolors the image in the scrollback as well.
+--play <file>: Play an asciicast recording, e.g. one made with --record.
+--probe   : Query the terminal capabilities again, and print them.
+-c <num>  : Number of thumbnail columns in 'dir' mode (3 by default).
+--compare : Show all images side by side, at the size of the first one.
+-d, --dir : Force 'dir' mode. Automatially selected for more than one input.
+--diff    : With --compare, mark the character cells that differ in another
+            image, and exit with 1 if there are any.
+--dither  : Ordered dithering with -2, --palette, --16 and --8.
+--exposure <stops>: Brighten or darken by <stops> before tone mapping, which
+            fits 16-bit and HDR images into the displayable range.
+-f, --full: Force 'full' mode. Automatically selected for one input.
+--filter <name>: Resampling filter: catmull-rom (default), mitchell or
+            lanczos3.
+--help    : Display this help text.
+--html    : Output an HTML document instead of escape codes.
+-i, --iterm: Output iTerm2 inline images.
+-h <num>  : Set the maximum output height to <num> lines.
+-j <num>  : Use <num> threads in all, or one per core with 0 (the default).
+-k, --kitty: Output images through the kitty graphics protocol.
+--max-pixels <num>: Decode larger images at reduced size where possible, and
+            refuse them otherwise. Accepts k, M and G suffixes.
+--max-memory <bytes>: The same for the memory needed to decode an image.
+--record <file>: Render an image or animation once into an asciicast v2
+            recording instead of showing it.
+--scroll  : Fit only the width of the terminal, and let tall images scroll by
+            as they are decoded.
+-s, --sixel: Output sixel graphics at the full pixel resolution.
+--snap    : Resize only by whole ratios: smaller, but faster and crisper.
+--sync <mode>: Synchronized updates for animations: auto, off, 2026 or dcs.
+-w <num>  : Set the maximum output width to <num> characters.
+-x        : Use new Unicode Teletext/legacy characters (experimental).)"
+              << std::endl;
+}
+
+enum Mode { AUTO, THUMBNAILS, FULL_SIZE, COMPARE };
+
+/**
+ * @brief Parses a number with an optional k, M or G suffix for thousands,
+ * millions or billions, or with binary set, for KiB, MiB or GiB.
+ *
+ * @throws std::invalid_argument If the text is no such number
+ */
+uint64_t parseAmount(const std::string &text, bool binary) {
+    size_t end;
+    double value = std::stod(text, &end);
+    size_t power = 0;
+    if (end < text.size()) {
+        power = std::string("kmg").find(std::tolower(text[end])) + 1;
+        if (power == 0 || value < 0) throw std::invalid_argument(text);
+    }
+    return value * std::pow(binary ? 1024 : 1000, power);
+}
+
+int main(int argc, char *argv[]) {
+    std::ios::sync_with_stdio(false);  // apparently makes printing faster
+    bool detectSize = true;
+
+    // Fallback sizes when unsuccesful. Sizes are actually 1/4th of the actual
+    int maxWidth = 80;
+    int maxHeight = 24;
+
+    // Reading input
+    int flags = FLAG_LINEAR;  // bitwise representation of flags,
+                              // see https://stackoverflow.com/a/14295472
+    Mode mode = AUTO;  // either THUMBNAIL, FULL_SIZE or COMPARE
+    bool diff = false;  // Whether to add a diff panel in COMPARE mode
+    int columns = 3;
+    SyncMode sync = SYNC_OFF;
+    bool detectSync = true;
+    bool reprobe = false;
+    bool scroll = false;  // Fit the width only, see scrollImage()
+    float exposure = 0;   // In stops
+    Budget budget;
+    std::string record;  // Where to record the animation to with --record
+    std::string play;    // Which recording to play with --play
+
+    std::vector<Input> file_names;
+    std::vector<std::unique_ptr<Archive>> archives;
+    // Archives contribute their members, other files themselves
+    auto addFile = [&](const std::string &filename) {
+        std::unique_ptr<Archive> archive = Archive::open(filename);
+        if (!archive) {
+            file_names.push_back({filename});
+            return;
+        }
+        for (size_t i = 0; i < archive->members().size(); i++) {
+            const std::string &name = archive->members()[i].name;
+            file_names.push_back({filename + "/" + name, archive.get(), i});
+        }
+        archives.push_back(std::move(archive));
+    };
+    int ret = EX_OK;  // The return code for the program
+
+    if (argc <= 1) {
+        printUsage();
+        return EX_USAGE;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg(argv[i]);
+        if (arg == "-0") {
+            flags |= FLAG_NOOPT;
+        } else if (arg == "-c") {
+            if (i < argc - 1) {
+                columns = std::stoi(argv[++i]);
+            } else {
+                std::cerr << "Error: -c requires a number" << std::endl;
+                ret = EX_USAGE;
+            }
+        } else if (arg == "--compare") {
+            mode = COMPARE;
+        } else if (arg == "-d" || arg == "--dir") {
+            mode = THUMBNAILS;
+        } else if (arg == "--diff") {
+            mode = COMPARE;
+            diff = true;
+        } else if (arg == "-f" || arg == "--full") {
+            mode = FULL_SIZE;
+        } else if (arg == "-w") {
+            if (i < argc - 1) {
+                maxWidth = 4 * std::stoi(argv[++i]), detectSize = false;
+            } else {
+                std::cerr << "Error: -w requires a number" << std::endl;
+                ret = EX_USAGE;
+            }
+        } else if (arg == "-h") {
+            if (i < argc - 1)
+                maxHeight = 8 * std::stoi(argv[++i]), detectSize = false;
+            else
+                printUsage();  // people might confuse this with help
+        } else if (arg == "--256" || arg == "-2" || arg == "-256") {
+            flags |= FLAG_MODE_256;
+        } else if (arg == "--16") {
+            flags |= FLAG_MODE_16;
+        } else if (arg == "--8") {
+            flags |= FLAG_MODE_8;
+        } else if (arg == "--dither") {
+            flags |= FLAG_DITHER;
+        } else if (arg == "--exposure") {
+            if (i < argc - 1) {
+                exposure = std::stof(argv[++i]);
+            } else {
+                std::cerr << "Error: --exposure requires a number" << std::endl;
+                ret = EX_USAGE;
+            }
+        } else if (arg == "--help" || arg == "-help") {
+            printUsage();
+        } else if (arg == "--html" || arg == "-html") {
+            flags |= FLAG_HTML;
+        } else if (arg == "-i" || arg == "--iterm") {
+            flags |= FLAG_ITERM;
+        } else if (arg == "--filter") {
+            std::string value = i < argc - 1 ? argv[++i] : "";
+            flags &= ~(FLAG_LANCZOS | FLAG_MITCHELL);
+            if (value == "lanczos3") {
+                flags |= FLAG_LANCZOS;
+            } else if (value == "mitchell") {
+                flags |= FLAG_MITCHELL;
+            } else if (value != "catmull-rom") {
+                std::cerr << "Error: --filter requires lanczos3, mitchell or "
+                             "catmull-rom"
+                          << std::endl;
+                ret = EX_USAGE;
+            }
+        } else if (arg == "-j") {
+            if (i < argc - 1) {
+                // 0 keeps the default of one thread per core
+                int jobs = std::stoi(argv[++i]);
+                if (jobs > 0) threadCount() = jobs;
+            } else {
+                std::cerr << "Error: -j requires a number" << std::endl;
+                ret = EX_USAGE;
+            }
+        } else if (arg == "-k" || arg == "--kitty") {
+            flags |= FLAG_KITTY;
+        } else if (arg == "--oklab") {
+            flags |= FLAG_OKLAB;
+        } else if (arg == "--palette") {
+            flags |= FLAG_PALETTE | FLAG_MODE_256;
+        } else if (arg == "--max-memory" || arg == "--max-pixels") {
+            if (i < argc - 1) {
+                const bool memory = arg == "--max-memory";
+                (memory ? budget.maxMemory : budget.maxPixels) =
+                    parseAmount(argv[++i], memory);
+            } else {
+                std::cerr << "Error: " << arg << " requires a number"
+                          << std::endl;
+                ret = EX_USAGE;
+            }
+        } else if (arg == "--no-linear") {
+            flags &= ~FLAG_LINEAR;
+        } else if (arg == "--play" || arg == "--record") {
+            if (i < argc - 1) {
+                (arg == "--play" ? play : record) = argv[++i];
+            } else {
+                std::cerr << "Error: " << arg << " requires a file name"
+                          << std::endl;
+                ret = EX_USAGE;
+            }
+        } else if (arg == "--probe") {
+            reprobe = true;
+        } else if (arg == "-s" || arg == "--sixel") {
+            flags |= FLAG_SIXEL;
+        } else if (arg == "--scroll") {
+            scroll = true;
+            mode = FULL_SIZE;
+        } else if (arg == "--snap") {
+            flags |= FLAG_SNAP;
+        } else if (arg == "--sync") {
+            std::string value = i < argc - 1 ? argv[++i] : "";
+            detectSync = value == "auto";
+            if (value == "off") {
+                sync = SYNC_OFF;
+            } else if (value == "2026") {
+                sync = SYNC_2026;
+            } else if (value == "dcs") {
+                sync = SYNC_DCS;
+            } else if (!detectSync) {
+                std::cerr << "Error: --sync requires auto, off, 2026 or dcs"
+                          << std::endl;
+                ret = EX_USAGE;
+            }
+        } else if (arg == "-x") {
+            flags |= FLAG_TELETEXT;
         } else if (arg[0] == '-') {
             std::cerr << "Error: Unrecognized argument: " << arg << std::endl;
             ret = EX_USAGE;
@@ -697,12 +5119,12 @@ int main(int argc, char *argv[]) {
             if (std::filesystem::is_directory(arg)) {
                 for (auto &p : std::filesystem::directory_iterator(arg))
                     if (std::filesystem::is_regular_file(p.path()))
-                        file_names.push_back(p.path().string());
+                        addFile(p.path().string());
             } else {
                 // Check if file can be opened, @TODO find better way
                 std::ifstream fin(arg.c_str());
                 if (fin) {
-                    file_names.push_back(arg);
+                    addFile(arg);
                 } else {
                     std::cerr << "Error: Cannot open '" << arg
                               << "', permission issue?" << std::endl;
@@ -712,6 +5134,41 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if (!play.empty()) {
+        if (!playCast(play)) {
+            std::cerr << "Error: '" << play
+                      << "' is not an asciicast v2 recording" << std::endl;
+            return EX_DATAERR;
+        }
+        return ret;
+    }
+    if (!record.empty()) {
+        if (file_names.size() != 1 || (flags & (FLAG_PIXELS | FLAG_HTML))) {
+            std::cerr << "Error: --record takes a single image, shown with "
+                         "escape codes"
+                      << std::endl;
+            return EX_USAGE;
+        }
+        mode = FULL_SIZE;
+    }
+    if (mode == COMPARE &&
+        (file_names.size() < 2 || (flags & (FLAG_PIXELS | FLAG_HTML)))) {
+        std::cerr << "Error: --compare takes two or more images, shown with "
+                     "escape codes"
+                  << std::endl;
+        return EX_USAGE;
+    }
+    // The palette is shared by everything on screen: redefining it for
+    // another image would recolor the ones already shown, including panels
+    // and thumbnails. So it is only used for a single image.
+    if (file_names.size() > 1) flags &= ~FLAG_PALETTE;
+
+#if cimg_use_openmp
+    // CImg's loops honor -j too, and run serially inside our parallel tasks
+    omp_set_num_threads(threadCount());
+    omp_set_max_active_levels(1);
+#endif
+
     if (detectSize) {
         // Platform-specific implementations for determining console size,
         // better implementations are welcome
@@ -746,64 +5203,218 @@ int main(int argc, char *argv[]) {
 #endif
     }
 
-    if (mode == FULL_SIZE || (mode == AUTO && file_names.size() == 1)) {
-        for (const auto &filename : file_names) {
+    // Probing only makes sense if we are writing to the terminal. Answers are
+    // cached, missing ones too, so we only pay for the round trip once per
+    // terminal.
+    TermCaps caps;
+#ifdef _POSIX_VERSION
+    if (isatty(STDOUT_FILENO) && (reprobe || !loadTermCaps(caps))) {
+        if (probeTermCaps(100, caps)) saveTermCaps(caps);
+        if (reprobe) {
+            std::cerr << std::format(
+                             "truecolor: {}, rep: {}, sync: {}, sixel: {}, "
+                             "kitty: {}, cell size: {}x{}",
+                             caps.truecolor, caps.rep, caps.sync, caps.sixel,
+                             caps.kitty, caps.cellWidth, caps.cellHeight)
+                      << std::endl;
+        }
+    }
+#endif
+    // Recordings are played elsewhere, often by players that lack REP
+    if (caps.rep && record.empty()) flags |= FLAG_REP;
+    if (flags & FLAG_HTML) flags &= ~FLAG_PIXELS;
+    // Only escape codes can use the adaptive palette
+    if (flags & (FLAG_PIXELS | FLAG_HTML)) flags &= ~FLAG_PALETTE;
+    if (detectSync && caps.sync) sync = SYNC_2026;
+
+    // Size of a character cell in image pixels. Pixel graphics use the actual
+    // pixels of the terminal, everything else 4x8 pixels per character.
+    int cellWidth = 4;
+    int cellHeight = 8;
+    if (flags & FLAG_PIXELS) {
+        cellWidth = caps.cellWidth ? caps.cellWidth : 10;
+        cellHeight = caps.cellHeight ? caps.cellHeight : 20;
+        maxWidth = maxWidth / 4 * cellWidth;
+        maxHeight = maxHeight / 8 * cellHeight;
+    }
+
+    if (flags & FLAG_HTML) output().write(HTML_HEADER);
+    if (mode == COMPARE) {
+        const int panels = file_names.size() + diff;
+        const int panelWidth =
+            std::max(4, (maxWidth - 2 * cellWidth * (panels - 1)) / panels);
+        std::vector<cimg_library::CImg<unsigned char>> images(
+            file_names.size());
+        std::vector<std::string> names, errors(file_names.size());
+        // Without all images there is nothing to compare: the first error
+        // cancels the decoding of images that have not started yet
+        TaskGroup decoding;
+        for (size_t i = 0; i < images.size(); i++) {
+            decoding.run([&, i] {
+                try {
+                    InputFile file(file_names[i], budget);
+                    images[i] =
+                        loadImage(file.path, size(panelWidth, maxHeight),
+                                  false, 1, flags, exposure, budget);
+                    return;
+                } catch (cimg_library::CImgIOException &e) {
+                    errors[i] = "has an unrecognized file format";
+                } catch (std::length_error &e) {
+                    errors[i] = e.what();
+                } catch (std::runtime_error &e) {
+                    errors[i] = std::string("cannot be extracted: ") + e.what();
+                }
+                decoding.cancel();
+            });
+        }
+        decoding.wait();
+        for (size_t i = 0; i < images.size(); i++) {
+            names.push_back(file_names[i].name);
+            if (!errors[i].empty()) {
+                std::cerr << "Error: '" << names[i] << "' " << errors[i]
+                          << std::endl;
+                ret = EX_DATAERR;
+            }
+        }
+        if (ret == EX_OK) {
+            // Cells only compare at the same size, that of the first image
+            parallelFor(images.size() - 1, [&](int i) {
+                cimg_library::CImg<unsigned char> &image = images[i + 1];
+                if (!image.is_sameXY(images[0])) {
+                    resizeImage(image, images[0].width(), images[0].height(),
+                                1, flags);
+                }
+            });
+            // Like cmp(1), for scripts
+            if (compareImages(images, names, diff, flags) && diff) ret = 1;
+        }
+    } else if (mode == FULL_SIZE || (mode == AUTO && file_names.size() == 1)) {
+        for (const auto &input : file_names) {
+            const std::string &filename = input.name;
             try {
-                cimg_library::CImg<unsigned char> image =
-                    load_rgb_CImg(filename.c_str());
-                if (image.width() > maxWidth || image.height() > maxHeight) {
-                    // scale image down to fit terminal size
-                    size new_size =
-                        size(image).fitted_within(size(maxWidth, maxHeight));
-                    image.resize(new_size.width, new_size.height, -100, -100,
-                                 5);
+                InputFile file(input, budget);
+                // The terminal decodes files passed through, so they are held
+                // to the budget too. Others are decoded here, at reduced size
+                // if need be.
+                if ((flags & FLAG_ITERM) && withinBudget(file.path, budget) &&
+                    printITermFile(file.path, maxWidth, maxHeight, cellWidth,
+                                   cellHeight)) {
+                    continue;
                 }
+                // Escape codes are written as the image is decoded
+                if (scroll && exposure == 0 && record.empty() &&
+                    !(flags & (FLAG_PIXELS | FLAG_HTML | FLAG_PALETTE)) &&
+                    scrollImage(file.path, maxWidth, flags, budget)) {
+                    continue;
+                }
+                // scale image down to fit terminal size
+                cimg_library::CImg<unsigned char> image = loadImage(
+                    file.path,
+                    size(maxWidth, scroll ? std::numeric_limits<int>::max()
+                                          : maxHeight),
+                    false, -100, flags, exposure, budget);
+                Palette palette;
+                if (flags & FLAG_PALETTE) {
+                    palette = record.empty() ? definePalette(image, flags)
+                                             : adaptivePalette(image, flags);
+                }
+                const Palette *adaptive =
+                    flags & FLAG_PALETTE ? &palette : nullptr;
                 // the actual magick which generates the output
-                printImage(image, flags);
-                std::cout.flush();  // replaces last endl to make sure we get
-                                    // output on screen
+                if (!record.empty()) {
+                    std::ofstream cast(record, std::ios::binary);
+                    recordAnimation(image, readGifDelays(file.path), flags,
+                                    adaptive, cast);
+                    if (!cast.flush()) {
+                        std::cerr << "Error: Cannot write '" << record << "'"
+                                  << std::endl;
+                        ret = EX_CANTCREAT;
+                    }
+                } else if (image.depth() > 1 && !(flags & FLAG_HTML)) {
+                    playAnimation(image, readGifDelays(file.path), flags,
+                                  sync, cellWidth, cellHeight, adaptive);
+                } else {
+                    printImage(image, flags, cellWidth, cellHeight, adaptive);
+                }
             } catch (cimg_library::CImgIOException &e) {
                 std::cerr << "Error: '" << filename
                           << "' has an unrecognized file format" << std::endl;
                 ret = EX_DATAERR;
+            } catch (std::length_error &e) {
+                std::cerr << "Error: '" << filename << "' " << e.what()
+                          << std::endl;
+                ret = EX_DATAERR;
+            } catch (std::runtime_error &e) {
+                std::cerr << "Error: '" << filename
+                          << "' cannot be extracted: " << e.what() << std::endl;
+                ret = EX_DATAERR;
             }
         }
     } else {  // Thumbnail mode
         unsigned int index = 0;
-        int cw = (((maxWidth / 4) - 2 * (columns - 1)) / columns);
-        int tw = cw * 4;
+        int cw = (((maxWidth / cellWidth) - 2 * (columns - 1)) / columns);
+        int tw = cw * cellWidth;
         cimg_library::CImg<unsigned char> image(
-            tw * columns + 2 * 4 * (columns - 1), tw, 1, 3);
+            tw * columns + 2 * cellWidth * (columns - 1), tw, 1, 3);
         size maxThumbSize(tw, tw);
 
+        // The inputs are decoded a row at a time, the next row in the
+        // background while the current one is shown
+        std::vector<cimg_library::CImg<unsigned char>> thumbnails(
+            file_names.size());
+        std::vector<std::unique_ptr<TaskGroup>> decoding(
+            (file_names.size() + columns - 1) / columns);
+        auto decodeRow = [&](size_t row, Priority priority) {
+            if (row >= decoding.size() || decoding[row]) return;
+            decoding[row] = std::make_unique<TaskGroup>(priority);
+            const size_t end =
+                std::min<size_t>((row + 1) * columns, file_names.size());
+            for (size_t i = row * columns; i < end; i++) {
+                decoding[row]->run([&, i] {
+                    try {
+                        InputFile file(file_names[i], budget);
+                        thumbnails[i] = loadImage(file.path, maxThumbSize, true,
+                                                  1, flags, exposure, budget);
+                    } catch (std::exception &e) {
+                        // Probably no image; ignore.
+                    }
+                });
+            }
+        };
+
         while (index < file_names.size()) {
             image.fill(0);
             int count = 0;
             std::string sb;
-            while (index < file_names.size() && count < columns) {
-                std::string name = file_names[index++];
-                try {
-                    cimg_library::CImg<unsigned char> original =
-                        load_rgb_CImg(name.c_str());
-                    auto cut = name.find_last_of("/");
-                    sb +=
-                        cut == std::string::npos ? name : name.substr(cut + 1);
-                    size newSize = size(original).fitted_within(maxThumbSize);
-                    original.resize(newSize.width, newSize.height, 1, -100, 5);
-                    image.draw_image(
-                        count * (tw + 8) + (tw - newSize.width) / 2,
-                        (tw - newSize.height) / 2, 0, 0, original);
-                    count++;
-                    unsigned int sl = count * (cw + 2);
-                    sb.resize(sl - 2, ' ');
-                    sb += "  ";
-                } catch (std::exception &e) {
-                    // Probably no image; ignore.
-                }
+            for (; index < file_names.size() && count < columns; index++) {
+                const size_t row = index / columns;
+                decodeRow(row, PRIORITY_NORMAL);
+                decoding[row]->wait();
+                // Only now, so waiting never picks the next row over this one
+                decodeRow(row + 1, PRIORITY_PREFETCH);
+                const cimg_library::CImg<unsigned char> original =
+                    std::move(thumbnails[index]);
+                if (original.is_empty()) continue;
+                const std::string &name = file_names[index].name;
+                auto cut = name.find_last_of("/");
+                sb += cut == std::string::npos ? name : name.substr(cut + 1);
+                image.draw_image(
+                    count * (tw + 2 * cellWidth) + (tw - original.width()) / 2,
+                    (tw - original.height()) / 2, 0, 0, original);
+                count++;
+                unsigned int sl = count * (cw + 2);
+                sb.resize(sl - 2, ' ');
+                sb += "  ";
             }
-            if (count) printImage(image, flags);
-            std::cout << sb << '\n' << std::endl;
+            if (count) printImage(image, flags, cellWidth, cellHeight);
+            output().write((flags & FLAG_HTML ? htmlEscape(sb) : sb) + "\n\n");
         }
     }
+    if (flags & FLAG_HTML) output().write(HTML_FOOTER);
+    // Restores the default colors, which also recolors the image in the
+    // scrollback
+    if ((flags & FLAG_PALETTE) && record.empty()) {
+        output().write("\x1b]104\x1b\\");
+    }
     return ret;
 }